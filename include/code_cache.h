@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "object.h"
+
+// Compiled form cache for source files.
+//
+// Reading a source file through ReadSourceFile stores its parsed forms in a cache file
+// next to it (PATH.cache). The cache is keyed by a hash of the source, kReaderVersion and
+// kImageVersion, so later reads of an unchanged file skip the tokenizer and the parser and
+// load the forms with the image deserializer instead. A checksum covers the forms. A stale,
+// corrupt or unwritable cache is never an error: the source is parsed as if there were no
+// cache at all.
+
+std::string CachePathFor(const std::string& source_path);
+
+std::vector<Object*> ReadSourceFile(const std::string& path);
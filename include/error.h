@@ -13,3 +13,8 @@ struct RuntimeError : public std::runtime_error {
 struct NameError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
+
+// Raised when an evaluation exceeds one of the limits it was run with
+struct LimitError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
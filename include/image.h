@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "object.h"
+
+// Binary object graph images.
+//
+// An image is a flat dump of every object reachable from a list of roots. Objects are
+// stored as tagged records that reference each other by record index, so loading is one
+// pass over a memory-mapped buffer that allocates the objects, followed by a relocation
+// pass that turns indices back into pointers. Built-in functions are stored by name and
+// resolved against the loading interpreter's own built-ins.
+//
+// Images are not portable: they are written in host byte order and are only accepted by
+// the same kImageVersion.
+
+constexpr uint32_t kImageVersion = 1;
+
+using BuiltinNames = std::unordered_map<Object*, std::string>;
+using BuiltinTable = std::unordered_map<std::string, Object*>;
+
+std::string DumpImage(const std::vector<Object*>& roots, const BuiltinNames& builtins);
+std::vector<Object*> LoadImage(const char* data, size_t size, const BuiltinTable& builtins);
+
+void WriteImageFile(const std::string& path, const std::vector<Object*>& roots,
+                    const BuiltinNames& builtins);
+std::vector<Object*> ReadImageFile(const std::string& path, const BuiltinTable& builtins);
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "object.h"
+#include "error.h"
+
+// Built-in functions backed by a plain C++ callable.
+//
+// The arity and the argument types are taken from the callable's signature: every
+// argument is evaluated exactly once, checked and converted on the way into the call,
+// and the result is converted back into an object. Supported types are
+//   int64_t     a Number
+//   double      a Number or a Real
+//   bool        any object, #f is false and everything else is true
+//   Object*     any object, including the empty list
+//   T*          an object of type T, where T derives from Object
+// and void, which returns the empty list.
+
+Object* Eval(Object* root, Scope* scope);
+
+template <class T>
+struct NativeArg;
+
+template <>
+struct NativeArg<int64_t> {
+    static int64_t From(Object* obj) {
+        if (!Is<Number>(obj)) {
+            throw RuntimeError{"Invalid parameter type"};
+        }
+        return As<Number>(obj)->GetValue();
+    }
+};
+
+template <>
+struct NativeArg<double> {
+    static double From(Object* obj) {
+        if (!IsNumeric(obj)) {
+            throw RuntimeError{"Invalid parameter type"};
+        }
+        return ToDouble(obj);
+    }
+};
+
+template <>
+struct NativeArg<bool> {
+    static bool From(Object* obj) {
+        return !(Is<Boolean>(obj) && !As<Boolean>(obj)->GetValue());
+    }
+};
+
+template <class T>
+struct NativeArg<T*> {
+    static_assert(std::is_base_of_v<Object, T>, "Native arguments must be objects");
+
+    static T* From(Object* obj) {
+        if constexpr (std::is_same_v<T, Object>) {
+            return obj;
+        } else {
+            if (!Is<T>(obj)) {
+                throw RuntimeError{"Invalid parameter type"};
+            }
+            return As<T>(obj);
+        }
+    }
+};
+
+template <class T>
+Object* NativeResult(T value) {
+    if constexpr (std::is_same_v<T, bool>) {
+        return Heap::Make<Boolean>(value);
+    } else if constexpr (std::is_integral_v<T>) {
+        return Heap::Make<Number>(value);
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return Heap::Make<Real>(value);
+    } else {
+        static_assert(std::is_convertible_v<T, Object*>, "Native results must be objects");
+        return value;
+    }
+}
+
+template <class F, class Signature>
+class NativeFunction;
+
+template <class F, class R, class... Args>
+class NativeFunction<F, R(Args...)> : public SchemaFunction {
+private:
+    F function_;
+
+    template <size_t... I>
+    Object* Call(const std::vector<Object*>& args, bool evaluate, std::index_sequence<I...>) {
+        if (args.size() < sizeof...(Args)) {
+            throw RuntimeError{"Not enough arguments in a function call"};
+        } else if (args.size() > sizeof...(Args)) {
+            throw RuntimeError{"Too many arguments in a function call"};
+        }
+        // Braced initialization evaluates the arguments left to right
+        std::tuple<std::decay_t<Args>...> converted{NativeArg<std::decay_t<Args>>::From(
+            evaluate ? Eval(args[I], CurrentScope::Get()) : args[I])...};
+        if constexpr (std::is_void_v<R>) {
+            std::apply(function_, std::move(converted));
+            return nullptr;
+        } else {
+            return NativeResult<R>(std::apply(function_, std::move(converted)));
+        }
+    }
+
+public:
+    NativeFunction(F function) : function_(std::move(function)) {
+    }
+
+    virtual Object* Invoke(const std::vector<Object*>& args) override {
+        return Call(args, true, std::index_sequence_for<Args...>());
+    }
+
+    virtual Object* Apply(const std::vector<Object*>& values) override {
+        return Call(values, false, std::index_sequence_for<Args...>());
+    }
+};
+
+template <class T>
+struct NativeSignature : NativeSignature<decltype(&T::operator())> {};
+
+template <class R, class... Args>
+struct NativeSignature<R (*)(Args...)> {
+    using Type = R(Args...);
+};
+
+template <class C, class R, class... Args>
+struct NativeSignature<R (C::*)(Args...) const> {
+    using Type = R(Args...);
+};
+
+template <class C, class R, class... Args>
+struct NativeSignature<R (C::*)(Args...)> {
+    using Type = R(Args...);
+};
+
+template <class F>
+SchemaFunction* MakeNativeFunction(F function) {
+    using Function = NativeFunction<F, typename NativeSignature<F>::Type>;
+    return Heap::Make<Function>(std::move(function));
+}
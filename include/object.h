@@ -1,17 +1,39 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
+#include <sys/types.h>
+
+#include "error.h"
+
+class Heap;
+class Scope;
+class TaskGroup;
 
 class Object {
+private:
+    friend class Heap;
+    // Position in the owning heap. Mark bits are kept by the heap, off the object, so a
+    // collection never writes to live objects (and never dirties pages shared after fork).
+    uint32_t heap_slot_ = 0;
+
 protected:
-    bool marked_ = false;
+    // Sets the mark bit, returns false if it was set already or the object is not owned by
+    // the active heap
+    bool TryMark();
 
 public:
+    // Marks the object and hands whatever it references to Heap::MarkLater
     virtual void Mark() = 0;
-    virtual void UnMark();
-    virtual bool IsMarked();
     virtual ~Object() = default;
 };
 
@@ -25,6 +47,18 @@ public:
     virtual void Mark() override;
 };
 
+// Double precision real. Number stays the exact integer type, arithmetic on a mix of the
+// two gives a Real.
+class Real : public Object {
+private:
+    double value_;
+
+public:
+    Real(double value);
+    double GetValue() const;
+    virtual void Mark() override;
+};
+
 class Symbol : public Object {
 private:
     std::string name_;
@@ -45,10 +79,113 @@ public:
     virtual void Mark() override;
 };
 
+// Immutable string. std::string keeps short strings inline, without a heap allocation.
+class String : public Object {
+private:
+    std::string value_;
+
+public:
+    String(std::string value);
+    const std::string& GetValue() const;
+    virtual void Mark() override;
+};
+
+// Mutable buffer for assembling large strings, appends are amortized O(1)
+class StringBuilder : public Object {
+private:
+    std::string buffer_;
+
+public:
+    void Append(const std::string& s);
+    const std::string& GetValue() const;
+    virtual void Mark() override;
+};
+
+// Destination of display, write and newline. Output is gathered in a buffer rather than
+// written a line at a time: a port on a file descriptor hands it to the system in large
+// blocks, when flushed and at exit, while a string port keeps all of it for
+// get-output-string.
+class OutputPort : public Object {
+private:
+    // Negative for a string port
+    int fd_;
+    std::string buffer_;
+    std::mutex mutex_;
+
+    bool FlushLocked();
+
+public:
+    // A string port
+    OutputPort();
+    explicit OutputPort(int fd);
+    ~OutputPort();
+
+    bool IsStringPort() const;
+    // Throws if the buffer had to be flushed and writing it out failed
+    void Write(std::string_view s);
+    // Returns false if the output could not be written, it is dropped then
+    bool Flush();
+    // Everything written to a string port so far
+    std::string GetString();
+
+    // The standard output, shared by every interpreter of the process. It belongs to no
+    // heap and is flushed when the process exits.
+    static OutputPort* Stdout();
+
+    virtual void Mark() override;
+};
+
+// What reading returns at the end of the input. There is a single one, which belongs to no
+// heap.
+class EofObject : public Object {
+public:
+    static EofObject* Get();
+    virtual void Mark() override;
+};
+
+// A file opened for reading. The file is mapped into memory instead of being read into a
+// buffer: lines and data are parsed straight out of the mapping, and only what is read
+// becomes objects. Pages the port moved past are handed back to the kernel, so reading a
+// file of any size takes about the same memory.
+class InputPort : public Object {
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    size_t position_ = 0;
+    // Start of the pages not handed back yet
+    size_t released_ = 0;
+    bool open_ = true;
+    std::mutex mutex_;
+
+    void RequireOpen() const;
+    void Advance(size_t position);
+
+public:
+    // Throws if the file can't be opened
+    explicit InputPort(const std::string& path);
+    ~InputPort();
+
+    // The next line without its line break, or nothing at the end of the file. The line
+    // is a view of the mapping, valid until the port is closed.
+    std::optional<std::string_view> ReadLine();
+    // The next datum, parsed by the same reader as source code, or EofObject at the end
+    Object* ReadDatum();
+    // Unmaps the file, reading from a closed port is an error
+    void Close();
+
+    virtual void Mark() override;
+};
+
 // Probably should be a quote here
 
 class Cell : public Object {
 private:
+    friend class Heap;
+    // Set once Heap::Intern shared the pair, see IsInterned. Fills the padding after the
+    // heap slot, so it costs no memory.
+    bool interned_ = false;
+    // Set once FoldConstants went over the form, which is then not walked again
+    bool folded_ = false;
     Object* first_ = nullptr;
     Object* second_ = nullptr;
 
@@ -81,28 +218,204 @@ public:
     Object* GetFirst() const;
     Object* GetSecond() const;
 
+    // Interned pairs may be shared by unrelated structures, so they are never mutated
+    bool IsInterned() const;
+
+    bool IsFolded() const;
+    void SetFolded();
+
     virtual void Mark() override;
 };
 
-class SchemaFunction : public Object {
+// Vectors made by size hold at most this many bytes of elements. Larger sizes are refused
+// up front, the allocation would fail or exhaust the memory of the process.
+constexpr size_t kMaxVectorBytes = size_t(1) << 31;
+
+// Fixed-size array with constant time indexing
+class Vector : public Object {
+private:
+    std::vector<Object*> elements_;
+
+    size_t CheckIndex(int64_t index) const;
+
 public:
-    virtual Object* Invoke(const std::vector<Object*>&) = 0;
+    Vector(std::vector<Object*> elements);
+    size_t Size() const;
+    // Both throw RuntimeError when the index is out of range
+    Object* Get(int64_t index) const;
+    void Set(int64_t index, Object* value);
+    void Fill(Object* value);
+    const std::vector<Object*>& GetElements() const;
     virtual void Mark() override;
 };
 
-class IsBooleanFunction : public SchemaFunction {
+// Homogeneous array of unboxed numbers, see uvector_kernels.h for the bulk operations
+template <class T>
+class UniformVector : public Object {
+private:
+    std::vector<T> data_;
+
+    size_t CheckIndex(int64_t index) const {
+        if (index < 0 || static_cast<uint64_t>(index) >= data_.size()) {
+            throw RuntimeError{"Vector index out of range"};
+        }
+        return index;
+    }
+
 public:
-    virtual Object* Invoke(const std::vector<Object*>&) override;
+    explicit UniformVector(std::vector<T> data) : data_(std::move(data)) {
+    }
+
+    size_t Size() const {
+        return data_.size();
+    }
+
+    const T* Data() const {
+        return data_.data();
+    }
+
+    T* Data() {
+        return data_.data();
+    }
+
+    T Get(int64_t index) const {
+        return data_[CheckIndex(index)];
+    }
+
+    void Set(int64_t index, T value) {
+        data_[CheckIndex(index)] = value;
+    }
+
+    virtual void Mark() override {
+        TryMark();
+    }
 };
 
-class NotFunction : public SchemaFunction {
+using U8Vector = UniformVector<uint8_t>;
+using S64Vector = UniformVector<int64_t>;
+using F64Vector = UniformVector<double>;
+
+// Hash table with open addressing and linear probing. Keys are compared with IsEqual, so
+// numbers, symbols and booleans match by value and lists and vectors by structure. Keys
+// must not be mutated while they are in a table.
+class HashTable : public Object {
+private:
+    enum class SlotState : uint8_t { EMPTY, FULL, DELETED };
+
+    struct Slot {
+        SlotState state = SlotState::EMPTY;
+        uint64_t hash = 0;
+        Object* key = nullptr;
+        Object* value = nullptr;
+    };
+
+    // The capacity is a power of two
+    std::vector<Slot> slots_;
+    size_t count_ = 0;
+    // Full and deleted slots, both lengthen the probe sequences
+    size_t used_ = 0;
+
+    // Either the slot holding the key or the first free one its probe sequence passes
+    size_t FindSlot(Object* key, uint64_t hash) const;
+    void Rehash(size_t capacity);
+
 public:
-    virtual Object* Invoke(const std::vector<Object*>&) override;
+    HashTable();
+    bool Lookup(Object* key, Object** value) const;
+    void Insert(Object* key, Object* value);
+    bool Remove(Object* key);
+    size_t Count() const;
+    std::vector<std::pair<Object*, Object*>> Entries() const;
+    virtual void Mark() override;
+};
+
+// The clauses of a case form compiled for dispatch: fixnum datums go through a dense table
+// when they are close together and through a hash map otherwise, symbols through a hash
+// map by name. Any other datum is compared with IsEqual in turn. The table takes the place
+// of the first clause in the form and stands for that clause when the form is printed or
+// stored in an image.
+class CaseTable : public Object {
+private:
+    std::vector<Object*> clauses_;
+    Object* else_clause_ = nullptr;
+    int64_t dense_base_ = 0;
+    std::vector<int32_t> dense_;
+    std::unordered_map<int64_t, size_t> fixnums_;
+    std::unordered_map<std::string, size_t> symbols_;
+    std::vector<std::pair<Object*, size_t>> others_;
+
+public:
+    // Each clause is ((datum ...) expr ...) or (else expr ...), else comes last
+    CaseTable(const std::vector<Object*>& clauses);
+    // The clause selected by the key, the else clause or null if there is none
+    Object* Find(Object* key) const;
+    Object* GetSource() const;
+    virtual void Mark() override;
 };
 
-class IsNumberFunction : public SchemaFunction {
+// An expression FoldConstants replaced by its constant value, or an if, and or or by what
+// remains of it. Eval evaluates the folded expression in its place for as long as the
+// builtins it relied on keep their names, the original one once any of them was rebound.
+// Printing and images see the original.
+class FoldedForm : public Object {
+private:
+    Object* original_;
+    Object* folded_;
+    // The global scope whose builtins the fold relied on, and its epoch at the time
+    Scope* global_;
+    uint64_t epoch_;
+
 public:
-    virtual Object* Invoke(const std::vector<Object*>&) override;
+    FoldedForm(Object* original, Object* folded, Scope* global);
+    // The expression to evaluate in place of this one
+    Object* Select() const;
+    Object* GetOriginal() const;
+    Object* GetFolded() const;
+    virtual void Mark() override;
+};
+
+// Calls fork(2), unless futures or parallel-map calls run anywhere in the process: their
+// threads would not exist in the child, which would inherit whatever locks they hold
+pid_t ForkProcess();
+
+
+// Folds the body of a (lambda formals body ...) or (define (name formals) body ...) form
+// in place, once per form: calls of foldable builtins on constants become their values,
+// ifs with a constant condition their chosen branch, and constant operands of and and or
+// are dropped. Names are resolved from the current scope, those bound locally or anywhere
+// but in the global scope are left alone. Does nothing while futures run, as another
+// thread could be evaluating the same code. Returns whether the form changed.
+bool FoldConstants(Cell* form);
+
+// The expression a call leaves to its caller, whose value becomes the value of the call.
+// scope stays null when the call has produced its value itself.
+struct TailCall {
+    // The form being evaluated, when the call comes from Eval. A special form may rewrite
+    // its own arguments in it into something faster to evaluate the next time.
+    Cell* call = nullptr;
+    Object* expr = nullptr;
+    Scope* scope = nullptr;
+};
+
+class SchemaFunction : public Object {
+private:
+    // Whether FoldConstants relies on what this function does, see SetFoldable
+    bool foldable_ = false;
+
+public:
+    // Receives the arguments unevaluated, as they appear in the call
+    virtual Object* Invoke(const std::vector<Object*>&) = 0;
+    // Like Invoke, but may leave the expression in tail position to Eval, which evaluates
+    // it in place of the call, so loops written as tail calls run in constant stack
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*);
+    // Receives already evaluated arguments, for calls made from native code
+    virtual Object* Apply(const std::vector<Object*>&);
+    virtual void Mark() override;
+
+    // Marks a builtin that FoldConstants may call on constants, or a special form whose
+    // syntax it knows. Rebinding a name from or to such a function invalidates the folds.
+    void SetFoldable();
+    bool IsFoldable() const;
 };
 
 class NumberEqFunction : public SchemaFunction {
@@ -160,11 +473,6 @@ public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class AbsFunction : public SchemaFunction {
-public:
-    virtual Object* Invoke(const std::vector<Object*>&) override;
-};
-
 class QuoteFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
@@ -185,72 +493,196 @@ public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class IsNullFunction : public SchemaFunction {
+class IsListFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class IsListFunction : public SchemaFunction {
+class MakeListFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class ConsFunction : public SchemaFunction {
+class AppendFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class CarFunction : public SchemaFunction {
+class ListTailFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class CdrFunction : public SchemaFunction {
+class ListRefFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class MakeListFunction : public SchemaFunction {
+class DefineFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
 };
 
-class ListTailFunction : public SchemaFunction {
+// (define-memoized (name arg ...) body ...), defines name as a memoized procedure
+class DefineMemoizedFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
 };
 
-class ListRefFunction : public SchemaFunction {
+// A special form whose value is that of an expression in tail position
+class TailForm : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override = 0;
+};
+
+class IfFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+};
+
+class BeginFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+};
+
+// let, let*, letrec and named let bind into a single new frame and evaluate their body
+// there, no closure is made except for the procedure of a named let
+class LetFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+};
+
+class LetStarFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
 };
 
-class IsSymbolFunction : public SchemaFunction {
+class LetrecFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+};
+
+// (do ((var init [step]) ...) (test expr ...) command ...), iterates without recursion
+class DoFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+};
+
+class CondFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+};
+
+// Compiles its clauses into a CaseTable on the first evaluation of the form
+class CaseFunction : public TailForm {
+public:
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+};
+
+class SetFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class DefineFunction : public SchemaFunction {
+class MakeVectorFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class IfFunction : public SchemaFunction {
+class VectorFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class SetFunction : public SchemaFunction {
+class SubstringFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class SetCarFunction : public SchemaFunction {
+class StringAppendFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
 
-class SetCdrFunction : public SchemaFunction {
+// (display obj [port]), (write obj [port]), (newline [port]) and (flush-output [port]),
+// the port is the standard output by default
+class DisplayFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class WriteFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class NewlineFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class FlushOutputFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+// (hash-table-ref table key [failure]), calls the failure thunk when the key is missing
+class HashTableRefFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* Apply(const std::vector<Object*>&) override;
+};
+
+// List procedures. They loop over the list spines, so long lists can't overflow the stack,
+// and call their function argument through Apply with the elements as they are.
+
+class MapFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class ForEachFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class FilterFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class FoldLeftFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class FoldRightFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class ReduceFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class ApplyFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+// The function given to parallel-map and parallel-for-each must be pure: it is called
+// concurrently on the thread pool and must not mutate shared bindings or lists.
+
+class ParallelMapFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class ParallelForEachFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
 };
@@ -259,13 +691,23 @@ class Scope : public Object {
 private:
     Scope* parent_ = nullptr;
     std::unordered_map<std::string, Object*> known_symbols_;
+    // Bumped by InvalidateFolding of a global scope, see FoldedForm
+    std::atomic<uint64_t> folding_epoch_{0};
 
 public:
     Scope(Scope* parent);
     Object* LookUpSymbol(const std::string&);
     Scope* IsDefined(const std::string&);
     Scope* GetParent();
+    void SetParent(Scope*);
+    const std::unordered_map<std::string, Object*>& GetSymbols() const;
     void DefineSymbol(const std::string&, Object*);
+    // The global scope this one is nested in, or this one if it has no parent
+    Scope* GetGlobal();
+    // Invalidates every FoldedForm made under this global scope so far, called whenever one
+    // of its foldable functions is rebound. Other interpreters keep their folds.
+    void InvalidateFolding();
+    uint64_t GetFoldingEpoch() const;
     virtual void Mark() override;
 };
 
@@ -285,6 +727,7 @@ private:
 class LambdaFunction : public SchemaFunction {
 public:
     virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
 };
 
 class LambdaImplFunction : public SchemaFunction {
@@ -295,11 +738,259 @@ private:
 
 public:
     LambdaImplFunction(const std::vector<std::string>&, const std::vector<Object*>&);
+    // Closes over the given scope instead of a new child of the current one
+    LambdaImplFunction(const std::vector<std::string>&, const std::vector<Object*>&, Scope*);
     Scope* GetScope();
+    void SetScope(Scope*);
+    const std::vector<std::string>& GetArgs() const;
+    const std::vector<Object*>& GetBody() const;
+    void SetBody(const std::vector<Object*>&);
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* InvokeTail(const std::vector<Object*>&, TailCall*) override;
+    virtual Object* Apply(const std::vector<Object*>&) override;
+    // Binds the values in a new frame and leaves the last expression of the body in tail
+    Object* ApplyTail(const std::vector<Object*>&, TailCall*);
+    virtual void Mark() override;
+};
+
+// A future evaluates its expression on the thread pool, allocating into a nursery heap of
+// its own. Touching it waits for the result, moves the nursery into the toucher's heap and
+// turns any error of the evaluation into a RuntimeError. A future that finished without
+// being touched hands its nursery over at the next collection of its heap. Like
+// parallel-map, the expression must not mutate bindings or lists it shares with the rest of
+// the program.
+
+class Future : public Object {
+private:
+    Object* expr_;
+    Scope* scope_;
+    std::unique_ptr<Heap> nursery_;
+    std::unique_ptr<TaskGroup> task_;
+    std::atomic<bool> finished_{false};
+    Object* value_ = nullptr;
+    // What the evaluation threw, rethrown as it is by Touch
+    std::exception_ptr error_;
+    // Whether the nursery was moved into the owning heap, the value lives there from then on
+    bool merged_ = false;
+
+public:
+    Future(Object* expr, Scope* scope);
+    ~Future();
+    bool IsPending() const;
+    void Wait();
+    // Waits for the evaluation and moves the nursery into the active heap, once
+    void MergeNursery();
+    Object* Touch();
+    virtual void Mark() override;
+};
+
+class FutureFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class TouchFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+// A procedure that caches the results of another one by their arguments, which are
+// compared with IsEqual and hashed with Hash. With a limit, the least recently used result
+// is dropped once there are more. Cached arguments and results are kept alive by the
+// cache, and arguments must not be mutated while they are cached.
+class MemoizedFunction : public SchemaFunction {
+private:
+    struct Entry {
+        std::vector<Object*> args;
+        Object* value;
+    };
+
+    struct ArgsHash {
+        size_t operator()(const std::vector<Object*>* args) const;
+    };
+
+    struct ArgsEqual {
+        bool operator()(const std::vector<Object*>* a, const std::vector<Object*>* b) const;
+    };
+
+    SchemaFunction* function_;
+    size_t limit_;
+    // Most recently used first, the index points into it
+    std::list<Entry> entries_;
+    std::unordered_map<const std::vector<Object*>*, std::list<Entry>::iterator, ArgsHash,
+                       ArgsEqual>
+        index_;
+    std::mutex mutex_;
+
+public:
+    // A limit of 0 means no limit
+    MemoizedFunction(SchemaFunction* function, size_t limit);
+    SchemaFunction* GetFunction() const;
+    void SetFunction(SchemaFunction*);
+    size_t GetLimit() const;
+    size_t Count();
+    void Clear();
     virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* Apply(const std::vector<Object*>&) override;
     virtual void Mark() override;
 };
 
+// (memoize procedure [limit])
+class MemoizeFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+// A value computed when it is first forced and kept from then on. Promises made by delay
+// evaluate an expression in the scope they captured, those made by the stream procedures
+// apply a procedure to arguments. Once forced, the expression, scope and arguments are
+// dropped, so the collector can reclaim whatever only they referenced.
+class Promise : public Object {
+private:
+    Object* expr_ = nullptr;
+    Scope* scope_ = nullptr;
+    SchemaFunction* function_ = nullptr;
+    std::vector<Object*> args_;
+    Object* value_ = nullptr;
+    bool forced_ = false;
+    // The arguments are handed to the stream procedure meanwhile
+    bool forcing_ = false;
+    // The procedure failed after what its arguments referenced may have been collected
+    bool abandoned_ = false;
+    std::mutex mutex_;
+
+public:
+    // An empty promise, for the image reader to fill in
+    Promise() = default;
+    Promise(Object* expr, Scope* scope);
+    Promise(SchemaFunction* function, std::vector<Object*> args);
+    // Already forced to the value, see make-promise
+    explicit Promise(Object* value);
+
+    // Computes the value unless that was done before. Should forcing the promise again
+    // while the value is computed finish first, its value is the one kept. A promise of a
+    // stream procedure doesn't hold on to its arguments while it is forced, so that what the
+    // procedure walks past can be collected. Forcing it again meanwhile is an error unless
+    // other threads are evaluating too, and so is forcing it again after the procedure failed
+    // past a collection.
+    Object* Force();
+
+    bool IsForced();
+    Object* GetValue();
+    Object* GetExpr();
+    Scope* GetScope();
+    SchemaFunction* GetFunction();
+    std::vector<Object*> GetArgs();
+    // Replaces the state of the promise as a whole, see the image reader
+    void Restore(bool forced, Object* value, Object* expr, Scope* scope,
+                 SchemaFunction* function, std::vector<Object*> args);
+
+    virtual void Mark() override;
+};
+
+// (delay expr) and (cons-stream head tail), the latter is (cons head (delay tail))
+class DelayFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+class ConsStreamFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+};
+
+// Stream procedures. A stream is either the empty list or a pair whose cdr is a promise of
+// the rest of the stream. The results are streams as well, computed an element at a time
+// as they are forced. Forced promises keep their values, but stream-filter and stream->list
+// collect the cells they walked past as they go, so a pipeline whose head nothing else
+// references, such as a variable, runs in memory bounded by what it returns.
+
+// (stream-map function stream)
+class StreamMapFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* Apply(const std::vector<Object*>&) override;
+};
+
+// (stream-filter predicate stream)
+class StreamFilterFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* Apply(const std::vector<Object*>&) override;
+};
+
+// (stream-take stream count), the first count elements or the whole stream if shorter
+class StreamTakeFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* Apply(const std::vector<Object*>&) override;
+};
+
+// (line-stream port), the lines of an input port, each read as it is forced
+class LineStreamFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>&) override;
+    virtual Object* Apply(const std::vector<Object*>&) override;
+};
+
+// The stream an object stands for: forces promises until there is none left, and checks
+// that the result is the empty list or a pair
+Object* ForceStream(Object* stream);
+
+// Walks the cells of a list in constant space. The walk ends at the empty list, at an
+// improper tail or, found by Floyd's cycle detection, in a circular list once every cell
+// has been seen at least once.
+class ListWalker {
+private:
+    Object* next_;
+    Object* slow_;
+    bool odd_ = false;
+    bool cyclic_ = false;
+
+public:
+    explicit ListWalker(Object* list);
+    // The next cell, or null once the walk has ended
+    Cell* Next();
+    // Where the walk ended: the empty list for a proper list, a cell for a circular one
+    Object* GetTail() const;
+    bool IsCyclic() const;
+    // Throws unless the walk ended at the empty list
+    void RequireProper() const;
+};
+
+Cell* Cons(Object* first, Object* second);
+
+// Conversions between proper lists and their elements, ListToVector throws on anything
+// that is not a proper list
+std::vector<Object*> ListToVector(Object* list);
+Object* VectorToList(const std::vector<Object*>& items);
+
+// List operations that walk their lists in constant space and throw on improper and
+// circular lists. The last list given to AppendLists is shared and may be any object,
+// CopyList keeps the tail of an improper list.
+size_t ListLength(Object* list);
+Object* ReverseList(Object* list);
+Object* AppendLists(const std::vector<Object*>& lists);
+Object* CopyList(Object* list);
+Cell* LastPair(Object* list);
+// The first tail of the list whose car is the same as obj, or #f
+Object* Member(Object* obj, Object* list, bool (*same)(Object*, Object*));
+// The first pair in the list of pairs whose car is the same as obj, or #f
+Object* Assoc(Object* obj, Object* alist, bool (*same)(Object*, Object*));
+
+// Numbers and reals
+bool IsNumeric(Object* obj);
+double ToDouble(Object* obj);
+
+// The equivalences of eq?, eqv? and equal?. Numbers, symbols and booleans are eq? by
+// value, since they are not unique objects here; reals are eqv? when they are the same
+// bits. IsEqual compares structure and terminates on circular structures.
+bool IsEq(Object* a, Object* b);
+bool IsEqv(Object* a, Object* b);
+bool IsEqual(Object* a, Object* b);
+// A hash function consistent with IsEqual
+uint64_t Hash(Object* obj);
+
 ///////////////////////////////////////////////////////////////////////////////
 
 // Runtime type checking and convertion.
@@ -315,21 +1006,137 @@ static bool Is(Object* obj) {
     return dynamic_cast<T*>(obj) != nullptr;
 }
 
+// Every interpreter owns a heap. The static interface works on the heap that is active
+// on the calling thread, so interpreters running on different threads never share objects.
+
+struct InternTable;
+
 class Heap {
 private:
+    // Indexed by heap slot, freed slots are null and reused
     std::vector<Object*> objs_;
-    explicit Heap();
+    std::vector<uint32_t> free_slots_;
+    std::vector<uint64_t> marks_;
+    std::vector<Object*> mark_stack_;
+    size_t allocations_ = 0;
+    size_t allocation_limit_ = SIZE_MAX;
+    // Futures that may still be running, these are roots for Cleanup
+    std::vector<Future*> futures_;
+    // Weak table of the objects shared by Intern, made on first use
+    std::unique_ptr<InternTable> interned_;
+
+    void Insert(Object* obj);
+    bool Owns(Object* obj) const;
+    // Adds the objects of the nursery that objects of this heap other than promises
+    // reference to found
+    void FindReferencesInto(const Heap& nursery, std::vector<Object*>* found);
+    // Drops the interned objects the last marking didn't reach
+    void PruneInterned();
+    // Merges the nurseries of the futures that finished and returns those still running
+    std::vector<Future*> MergeFinishedFutures();
+    // Deletes the objects the last marking didn't reach
+    void Sweep();
 
 public:
+    // Makes a heap active on the current thread for the lifetime of the object
+    class Activation {
+    private:
+        Heap* previous_;
+
+    public:
+        explicit Activation(Heap* heap);
+        Activation(const Activation&) = delete;
+        Activation& operator=(const Activation&) = delete;
+        ~Activation();
+    };
+
+    // Lends a nursery heap to a loop that calls back into Scheme, such as for-each-line, so
+    // that the garbage of its iterations doesn't pile up until the Run ends. Objects made
+    // meanwhile go to the nursery, which is merged into the lending heap when the loop ends.
+    class LoopNursery {
+    private:
+        Heap* lender_;
+        // The loop this one runs in, if the lender is that loop's nursery
+        LoopNursery* enclosing_;
+        LoopNursery* previous_;
+        std::unique_ptr<Heap> heap_;
+        Activation activation_;
+        size_t collected_at_ = 0;
+        // Objects the last collection kept
+        size_t survivors_ = 0;
+
+    public:
+        LoopNursery();
+        LoopNursery(const LoopNursery&) = delete;
+        LoopNursery& operator=(const LoopNursery&) = delete;
+        // A safe point in between iterations, collects the nursery once the loop allocated
+        // enough. The roots are all the loop itself still references. The current scope and
+        // the nursery objects stored in the lending heaps are kept too, those stored in
+        // their promises only where something else keeps the promise.
+        void Collect(const std::vector<Object*>& roots);
+        ~LoopNursery();
+
+        // Number of collections loops ran on the current thread so far
+        static uint64_t Collections();
+    };
+
+    explicit Heap();
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
     template <class T, class... Args>
     static T* Make(Args... args) {
-        Instance().objs_.push_back(new T(std::forward<Args>(args)...));
-        return As<T>(Instance().objs_.back());
+        if (++Instance().allocations_ > Instance().allocation_limit_) {
+            AllocationLimitExceeded();
+        }
+        T* obj = new T(std::forward<Args>(args)...);
+        Instance().Insert(obj);
+        ChargePayload(obj);
+        return obj;
     }
 
     static Heap& Instance();
 
-    static void Cleanup(Scope* global_scope);
+    // Number of objects ever made in the active heap, and a cap on it
+    static size_t Allocations();
+    static size_t AllocationLimit();
+    static void SetAllocationLimit(size_t limit);
+    // Counts the elements of an object about to be made like as many objects, so that a
+    // single huge vector is held to the cap too
+    static void ChargeElements(size_t count);
+    // Counts every pointer-sized word of a payload, such as the characters of a string or
+    // the numbers of a uniform vector, like an object
+    static void ChargeBytes(size_t bytes);
+    // Charges what objects of variable size hold besides themselves as they are made
+    static void ChargePayload(Object*) {
+    }
+    static void ChargePayload(String* obj);
+    static void ChargePayload(Symbol* obj);
+    [[noreturn]] static void AllocationLimitExceeded();
+
+    static void Cleanup(const std::vector<Object*>& roots);
+
+    // Queues an object for marking. Marking works off this queue rather than recursing,
+    // so long lists can't overflow the stack.
+    static void MarkLater(Object* obj);
+    // Sets the mark bit of one of this heap's objects, see Object::TryMark
+    bool SetMark(Object* obj);
+
+    // Takes over every object of another heap, e.g. a worker thread's nursery
+    void Merge(Heap* other);
+
+    static void AddFuture(Future* future);
+    bool HasPendingFutures() const;
+
+    // Hash-consing: returns a structurally equal copy of obj in which equal parts are shared
+    // with everything else interned in the active heap, so equal data is stored once and
+    // compares equal by pointer. Numbers, reals, symbols, strings, booleans and pairs are
+    // interned, other objects are kept as they are. Interned pairs are immutable and
+    // circular structures can't be interned. Collections drop the entries nothing else
+    // references. Pairs of obj are left alone and copied, unless reuse_pairs allows them to
+    // become the canonical ones, for data nothing else references yet such as what the
+    // reader just produced.
+    static Object* Intern(Object* obj, bool reuse_pairs = false);
 
     ~Heap();
 };
@@ -1,8 +1,19 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 
 #include "object.h"
 #include <tokenizer.h>
 
-Object* Read(Tokenizer* tokenizer);
\ No newline at end of file
+// Changes whenever the tokenizer or the parser read a source text differently, so that forms
+// an older reader cached are parsed again, see code_cache.h. Strings made it 2, reals 3,
+// reals without an integer part such as -.5 4.
+constexpr uint32_t kReaderVersion = 4;
+
+Object* Read(Tokenizer* tokenizer);
+
+// Replaces the datum of every quote in a parsed form with its interned copy, see
+// Heap::Intern. Only quoted data is shared: code is evaluated in place and may be
+// rewritten by the evaluator, so it is left as it is.
+Object* InternQuotedData(Object* form);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Wire format of the evaluation server. Both directions use length-prefixed frames with
+// big-endian lengths:
+//   request   u32 length, expression
+//   response  u8 status, u32 length, serialized result or error message
+// A connection may carry any number of requests, each answered before the next is read.
+// The functions return false once the peer is gone or sent a malformed frame. No frame is
+// larger than kMaxFrameSize: WriteRequest refuses a larger expression and WriteResponse
+// answers LIMIT_EXCEEDED in place of a larger result.
+
+enum class ResponseStatus : uint8_t { OK, SYNTAX_ERROR, RUNTIME_ERROR, NAME_ERROR, LIMIT_EXCEEDED };
+
+constexpr uint32_t kMaxFrameSize = 16 << 20;
+
+bool ReadRequest(int fd, std::string* expr);
+bool WriteRequest(int fd, const std::string& expr);
+
+bool ReadResponse(int fd, ResponseStatus* status, std::string* payload);
+bool WriteResponse(int fd, ResponseStatus status, const std::string& payload);
@@ -1,13 +1,104 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
 #include <string>
+#include <vector>
+#include <sys/types.h>
 #include "object.h"
+#include "native.h"
+
+// Lets another thread stop a Run in progress. The token is polled together with the
+// other limits, so the Run stops within a few microseconds rather than instantly.
+class CancellationToken {
+private:
+    std::atomic<bool> cancelled_{false};
+
+public:
+    void Cancel();
+    void Reset();
+    bool IsCancelled() const;
+};
+
+// Limits of a single Run. Exceeding any of them, or cancelling the run, raises LimitError
+// and leaves the interpreter usable for the next Run. A Run without limits pays a single
+// branch per call for this.
+struct RunLimits {
+    // Evaluation stops once this point in time has passed
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    // At most this many function calls may be evaluated
+    std::optional<uint64_t> step_budget;
+    // Evaluation stops once the token is cancelled
+    const CancellationToken* cancellation = nullptr;
+    // At most this many objects may be allocated, zero means no limit. The elements of
+    // vectors made by make-vector and the like count as objects, and so does every
+    // pointer-sized word of strings, string ports and uniform vectors.
+    size_t max_allocations = 0;
+    // Evaluations may nest at most this deep, zero means no limit. Keeps runaway recursion
+    // from overflowing the stack of the thread that runs it.
+    size_t max_depth = 0;
+};
 
 class Interpreter {
 private:
+    // Owns every object of this interpreter, see Heap
+    std::unique_ptr<Heap> heap_;
     Scope* global_scope_ = nullptr;
+    // Every built-in function by name, kept alive even when the global binding is replaced
+    Scope* builtins_ = nullptr;
+    // Whether quoted data is interned as it is read, see SetHashConsing
+    bool hash_consing_ = false;
+
+    void DefineBuiltin(const std::string&, Object*);
+
+    // Defines the builtins of one uniform vector type, e.g. make-u8vector for "u8"
+    template <class T>
+    void DefineUniformVector(const std::string& prefix);
 
 public:
     explicit Interpreter();
+    Interpreter(const Interpreter&) = delete;
+    Interpreter& operator=(const Interpreter&) = delete;
     std::string Run(const std::string&);
+    std::string Run(const std::string&, const RunLimits&);
+
+    // Evaluates the expressions in order and returns their serialized results. Unlike a
+    // loop over Run, garbage is collected once per batch, or in between expressions when
+    // they allocated a lot. The limits apply to the batch as a whole. Stops at the first
+    // error, which is rethrown; definitions made by earlier expressions stay.
+    std::vector<std::string> RunBatch(const std::vector<std::string>& exprs);
+    std::vector<std::string> RunBatch(const std::vector<std::string>& exprs,
+                                      const RunLimits& limits);
+
+    // Defines a built-in backed by a C++ callable, see native.h for the supported types:
+    //   interp.RegisterFunction("square", [](int64_t x) { return x * x; });
+    template <class F>
+    void RegisterFunction(const std::string& name, F function) {
+        Heap::Activation activation(heap_.get());
+        DefineBuiltin(name, MakeNativeFunction(std::move(function)));
+    }
+
+    // Forks the process, returning like fork(2). The child gets a copy-on-write clone of
+    // this interpreter that costs next to nothing to make: pages of the warmed heap are
+    // only copied once the child writes to them. Garbage collection keeps its mark bits off the
+    // objects, so a collection in the child does not unshare the heap either. Fails while
+    // futures or parallel-map calls are running in any interpreter of the process, their
+    // threads would not exist in the child.
+    pid_t Fork();
+
+    // Hash-consing of quoted data: once enabled, the datum of every quote read by Run,
+    // RunBatch and Load is interned (see Heap::Intern). Equal constants, e.g. the same
+    // configuration loaded twice, are then stored once, compare equal by pointer and
+    // can't be mutated. Off by default.
+    void SetHashConsing(bool enabled);
+
+    // Evaluates every form of a source file, going through its compiled form cache
+    void Load(const std::string& path);
+
+    // Dumps the global scope and everything reachable from it, so that a warmed up
+    // interpreter can be restored by LoadImage instead of re-evaluating its prelude.
+    void SaveImage(const std::string& path);
+    void LoadImage(const std::string& path);
 };
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Evaluation server.
+//
+// Listens on a Unix domain socket and evaluates requests (see protocol.h) on a pool of
+// interpreters that are initialized once, up front, from an image and/or source files.
+// Every connection is served by a thread of its own, which borrows a free interpreter for
+// each request. Definitions made by a request stay in the interpreter that ran it, unless
+// requests are isolated: then each one runs in a forked copy of the interpreter that is
+// thrown away afterwards, so every request sees the same freshly warmed state.
+
+struct ServerOptions {
+    std::string socket_path;
+    // Zero means one per core
+    size_t interpreters = 0;
+    // Per request limits, see RunLimits
+    std::chrono::milliseconds time_limit{1000};
+    size_t heap_limit = 10000000;
+    size_t depth_limit = 10000;
+    // Runs every request in a forked child, see Interpreter::Fork
+    bool isolate = false;
+    // Interns quoted data, see Interpreter::SetHashConsing
+    bool hash_cons = false;
+    // Every interpreter of the pool starts from these
+    std::string image;
+    std::vector<std::string> files;
+};
+
+// Serves forever, returns only if the pool or the socket could not be set up
+int RunServer(const ServerOptions& options);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool.
+//
+// Every worker owns a queue: it pushes and pops its own tasks at the back and steals from
+// the front of other queues when it runs dry. Tasks submitted from outside the pool are
+// spread over the queues round-robin. Threads waiting for tasks (see TaskGroup) help by
+// running queued tasks instead of blocking, so waiting from inside a task can't deadlock.
+
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(size_t threads);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    // The process-wide pool, sized by SCHEME_THREADS or the number of cores. A child
+    // process made by fork starts a pool of its own on first use.
+    static ThreadPool& Instance();
+
+    size_t Size() const;
+    void Submit(Task task);
+
+    // Runs one queued task on the calling thread, returns false if there was none
+    bool RunPending();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> next_queue_{0};
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wakeup_;
+    size_t pending_ = 0;
+    bool stop_ = false;
+
+    bool TryPop(size_t preferred, Task* task);
+    void WorkerLoop(size_t index);
+};
+
+// A set of tasks that can be waited for together. The first exception thrown by any of
+// them is rethrown by Wait once all of them have finished.
+
+class TaskGroup {
+private:
+    ThreadPool& pool_;
+    std::mutex mutex_;
+    std::condition_variable done_;
+    size_t remaining_ = 0;
+    std::exception_ptr error_;
+
+public:
+    explicit TaskGroup(ThreadPool& pool = ThreadPool::Instance());
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+    ~TaskGroup();
+
+    void Run(ThreadPool::Task task);
+    void Wait();
+};
@@ -35,14 +35,33 @@ struct ConstantToken {
     bool operator==(const ConstantToken& other) const;
 };
 
-using Token =
-    std::variant<ConstantToken, BracketToken, SymbolToken, QuoteToken, DotToken, BooleanToken>;
+struct RealToken {
+    double value;
+
+    RealToken(double value);
+
+    bool operator==(const RealToken& other) const;
+};
+
+// A string literal, with its escapes already resolved
+struct StringToken {
+    std::string value;
+
+    StringToken(const std::string& value);
+
+    bool operator==(const StringToken& other) const;
+};
+
+using Token = std::variant<ConstantToken, BracketToken, SymbolToken, QuoteToken, DotToken,
+                           BooleanToken, StringToken, RealToken>;
 
 class Tokenizer {
 private:
     std::istream* in_ = nullptr;
     Token current_token_ = ConstantToken(0);
     bool end_ = false;
+    // Stream position right after the previous token, -1 if the stream can't tell
+    std::streamoff consumed_ = -1;
 
     bool IsStartForSymbol(char nc);
 
@@ -50,6 +69,15 @@ private:
 
     void ParseTokenAndStore();
 
+    std::string ParseString();
+
+    // Whether a '.' and a digit are next in the stream, as in .5, reading neither
+    bool AtFraction();
+
+    // Reads an integer or a decimal real whose first digit or leading '.' is next in the
+    // stream
+    Token ParseNumber(bool negative);
+
 public:
     Tokenizer(std::istream* in);
 
@@ -58,4 +86,8 @@ public:
     void Next();
 
     Token GetToken();
-};
\ No newline at end of file
+
+    // Stream position right after the tokens handed out so far. The tokenizer reads a
+    // token ahead, so this is where a reader of the rest of the stream has to pick up.
+    std::streamoff Consumed() const;
+};
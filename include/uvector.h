@@ -0,0 +1,111 @@
+#pragma once
+
+#include <string>
+
+#include "native.h"
+#include "uvector_kernels.h"
+
+// Built-in functions for the uniform vectors u8vector, s64vector and f64vector. Elements
+// are converted on the way in and out, the vectors themselves never hold objects.
+
+template <class T>
+struct UniformElement;
+
+template <>
+struct UniformElement<uint8_t> {
+    static uint8_t From(Object* obj) {
+        int64_t value = NativeArg<int64_t>::From(obj);
+        if (value < 0 || value > 255) {
+            throw RuntimeError{"Byte out of range"};
+        }
+        return value;
+    }
+
+    static Object* To(uint8_t value) {
+        return Heap::Make<Number>(value);
+    }
+};
+
+template <>
+struct UniformElement<int64_t> {
+    static int64_t From(Object* obj) {
+        return NativeArg<int64_t>::From(obj);
+    }
+
+    static Object* To(int64_t value) {
+        return Heap::Make<Number>(value);
+    }
+};
+
+template <>
+struct UniformElement<double> {
+    static double From(Object* obj) {
+        return NativeArg<double>::From(obj);
+    }
+
+    static Object* To(double value) {
+        return Heap::Make<Real>(value);
+    }
+};
+
+// (make-u8vector size [fill])
+template <class T>
+class MakeUniformVectorFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>& args) override {
+        if (args.empty()) {
+            throw RuntimeError{"Not enough arguments in a function call"};
+        } else if (args.size() > 2) {
+            throw RuntimeError{"Too many arguments in a function call"};
+        }
+        int64_t size = NativeArg<int64_t>::From(Eval(args[0], CurrentScope::Get()));
+        if (size < 0) {
+            throw RuntimeError{"Vector size must not be negative"};
+        } else if (uint64_t(size) > kMaxVectorBytes / sizeof(T)) {
+            throw RuntimeError{"Vector size is too large"};
+        }
+        T fill = args.size() == 2 ? UniformElement<T>::From(Eval(args[1], CurrentScope::Get()))
+                                  : T();
+        Heap::ChargeBytes(size * sizeof(T));
+        return Heap::Make<UniformVector<T>>(std::vector<T>(size, fill));
+    }
+};
+
+// (u8vector element ...)
+template <class T>
+class UniformVectorFunction : public SchemaFunction {
+public:
+    virtual Object* Invoke(const std::vector<Object*>& args) override {
+        std::vector<T> data(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
+            data[i] = UniformElement<T>::From(Eval(args[i], CurrentScope::Get()));
+        }
+        Heap::ChargeBytes(data.size() * sizeof(T));
+        return Heap::Make<UniformVector<T>>(std::move(data));
+    }
+};
+
+// Calls function with the argument cast to its actual uniform vector type
+template <class F>
+Object* WithUniformVector(Object* obj, F function) {
+    if (Is<U8Vector>(obj)) {
+        return function(As<U8Vector>(obj));
+    } else if (Is<S64Vector>(obj)) {
+        return function(As<S64Vector>(obj));
+    } else if (Is<F64Vector>(obj)) {
+        return function(As<F64Vector>(obj));
+    }
+    throw RuntimeError{"Invalid parameter type"};
+}
+
+// The second operand of a binary kernel, which must match the first in type and length
+template <class T>
+UniformVector<T>* SameShape(UniformVector<T>* a, Object* b) {
+    if (!Is<UniformVector<T>>(b)) {
+        throw RuntimeError{"Vectors must have the same element type"};
+    }
+    if (As<UniformVector<T>>(b)->Size() != a->Size()) {
+        throw RuntimeError{"Vectors must have the same length"};
+    }
+    return As<UniformVector<T>>(b);
+}
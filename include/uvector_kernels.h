@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Kernels over the elements of uniform vectors (u8vector, s64vector and f64vector).
+//
+// Each kernel is built twice on x86-64, for the baseline SSE2 and for AVX2, and the
+// dynamic loader picks the variant the CPU supports. Other targets get the portable
+// build only. Integer arithmetic wraps around; the u8 sum and dot product are exact.
+// Sums and dot products of reals are computed in a different order than left to right,
+// so they may differ from a sequential sum in the last bits.
+
+int64_t KernelSum(const uint8_t* a, size_t n);
+int64_t KernelSum(const int64_t* a, size_t n);
+double KernelSum(const double* a, size_t n);
+
+int64_t KernelDot(const uint8_t* a, const uint8_t* b, size_t n);
+int64_t KernelDot(const int64_t* a, const int64_t* b, size_t n);
+double KernelDot(const double* a, const double* b, size_t n);
+
+// Both require n > 0
+uint8_t KernelMin(const uint8_t* a, size_t n);
+int64_t KernelMin(const int64_t* a, size_t n);
+double KernelMin(const double* a, size_t n);
+uint8_t KernelMax(const uint8_t* a, size_t n);
+int64_t KernelMax(const int64_t* a, size_t n);
+double KernelMax(const double* a, size_t n);
+
+// Element-wise, out may alias the inputs
+void KernelAdd(const uint8_t* a, const uint8_t* b, uint8_t* out, size_t n);
+void KernelAdd(const int64_t* a, const int64_t* b, int64_t* out, size_t n);
+void KernelAdd(const double* a, const double* b, double* out, size_t n);
+void KernelMul(const uint8_t* a, const uint8_t* b, uint8_t* out, size_t n);
+void KernelMul(const int64_t* a, const int64_t* b, int64_t* out, size_t n);
+void KernelMul(const double* a, const double* b, double* out, size_t n);
+void KernelScale(const uint8_t* a, uint8_t k, uint8_t* out, size_t n);
+void KernelScale(const int64_t* a, int64_t k, int64_t* out, size_t n);
+void KernelScale(const double* a, double k, double* out, size_t n);
@@ -1,44 +1,152 @@
 #include <iostream>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 
 #include "scheme.h"
+#include "server.h"
 #include "error.h"
 
 #include <stdio.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
-int main() {
+void PrintUsage() {
+    std::cerr << "Usage: scheme [--image PATH] [--dump-image PATH] [--hash-cons] [FILE...]"
+              << std::endl;
+    std::cerr << "       scheme --serve SOCKET [--workers N] [--time-limit MS] [--heap-limit N]"
+              << " [--isolate] [--image PATH] [FILE...]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string image;
+    std::string dump_image;
+    std::vector<std::string> files;
+    ServerOptions server;
+    bool hash_cons = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--image") && i + 1 < argc) {
+            image = argv[++i];
+        } else if (!std::strcmp(argv[i], "--dump-image") && i + 1 < argc) {
+            dump_image = argv[++i];
+        } else if (!std::strcmp(argv[i], "--serve") && i + 1 < argc) {
+            server.socket_path = argv[++i];
+        } else if (!std::strcmp(argv[i], "--workers") && i + 1 < argc) {
+            server.interpreters = std::strtoul(argv[++i], nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--time-limit") && i + 1 < argc) {
+            server.time_limit = std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+        } else if (!std::strcmp(argv[i], "--heap-limit") && i + 1 < argc) {
+            server.heap_limit = std::strtoul(argv[++i], nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--isolate")) {
+            server.isolate = true;
+        } else if (!std::strcmp(argv[i], "--hash-cons")) {
+            hash_cons = true;
+        } else if (argv[i][0] != '-') {
+            files.push_back(argv[i]);
+        } else {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if (!server.socket_path.empty()) {
+        server.image = image;
+        server.files = files;
+        server.hash_cons = hash_cons;
+        return RunServer(server);
+    }
     Interpreter interp;
+    interp.SetHashConsing(hash_cons);
+    if (!image.empty()) {
+        try {
+            interp.LoadImage(image);
+        } catch (const RuntimeError& err) {
+            std::cerr << "Could not load image: " << err.what() << std::endl;
+            return 1;
+        }
+    }
+    for (auto& x : files) {
+        try {
+            interp.Load(x);
+        } catch (const SyntaxError& err) {
+            std::cerr << x << ": Syntax error: " << err.what() << std::endl;
+            return 1;
+        } catch (const RuntimeError& err) {
+            std::cerr << x << ": Runtime error: " << err.what() << std::endl;
+            return 1;
+        } catch (const NameError& err) {
+            std::cerr << x << ": Name error: " << err.what() << std::endl;
+            return 1;
+        }
+    }
+    if (!files.empty()) {
+        if (!dump_image.empty()) {
+            interp.SaveImage(dump_image);
+        }
+        return 0;
+    }
     std::vector<std::string> hist;
     std::time_t cur_time = std::chrono::system_clock::to_time_t(std::chrono::high_resolution_clock::now());
     std::string str_time = std::string(std::ctime(&cur_time));
     str_time.pop_back();
     rl_bind_key ('\t', rl_insert);
     std::cout << "Scheme Interpreter (v1.0.0) [" << str_time << "] on linux" << std::endl;
-    while (true) {
+    bool eof = false;
+    while (!eof) {
         int balance = 0;
+        // Brackets inside string literals don't count, and a literal may span lines
+        bool in_string = false;
+        bool escaped = false;
         std::string total_cmd = "";
         bool first = true;
         do {
-            std::string cmd = readline(first ? ">>> " : "... ");
+            char* line = readline(first ? ">>> " : "... ");
+            if (line == nullptr) {
+                eof = true;
+                break;
+            }
+            std::string cmd = line;
+            std::free(line);
             add_history(cmd.c_str());
             for (auto &x : cmd) {
-                if (x == '(') ++balance;
+                if (in_string) {
+                    if (escaped) escaped = false;
+                    else if (x == '\\') escaped = true;
+                    else if (x == '"') in_string = false;
+                }
+                else if (x == '"') in_string = true;
+                else if (x == '(') ++balance;
                 else if (x == ')') --balance;
             }
             first = false;
-            total_cmd += cmd + " ";
-        } while (balance != 0);
+            total_cmd += cmd + (in_string ? "\n" : " ");
+        } while (balance != 0 || in_string);
+        if (eof) {
+            std::cout << std::endl;
+            break;
+        }
         try {
-            std::cout << interp.Run(total_cmd) << std::endl;
+            std::string result = interp.Run(total_cmd);
+            // Whatever the expression displayed goes out before its value
+            OutputPort::Stdout()->Flush();
+            std::cout << result << std::endl;
         } catch (const SyntaxError& err) {
+            OutputPort::Stdout()->Flush();
             std::cout << "Syntax error: " << err.what() << std::endl;
         } catch (const RuntimeError& err) {
+            OutputPort::Stdout()->Flush();
             std::cout << "Runtime error: " << err.what() << std::endl;
         } catch (const NameError& err) {
+            OutputPort::Stdout()->Flush();
             std::cout << "Name error: " << err.what() << std::endl;
         }
     }
+    if (!dump_image.empty()) {
+        try {
+            interp.SaveImage(dump_image);
+        } catch (const RuntimeError& err) {
+            std::cerr << "Could not dump image: " << err.what() << std::endl;
+            return 1;
+        }
+    }
     return 0;
 }
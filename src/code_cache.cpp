@@ -0,0 +1,124 @@
+#include "code_cache.h"
+#include "image.h"
+#include "parser.h"
+#include "error.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kCacheMagic[8] = {'S', 'C', 'M', 'C', 'A', 'C', 'H', 'E'};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t reader_version;
+    uint32_t image_version;
+    uint64_t source_hash;
+    uint64_t payload_checksum;
+};
+
+uint64_t Hash(const char* data, size_t size) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+CacheHeader MakeHeader(uint64_t source_hash, uint64_t payload_checksum) {
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kCacheMagic, sizeof(header.magic));
+    header.reader_version = kReaderVersion;
+    header.image_version = kImageVersion;
+    header.source_hash = source_hash;
+    header.payload_checksum = payload_checksum;
+    return header;
+}
+
+bool ReadCache(const std::string& path, uint64_t source_hash, std::vector<Object*>* forms) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(CacheHeader)) {
+        return false;
+    }
+    const char* payload = data.data() + sizeof(CacheHeader);
+    size_t payload_size = data.size() - sizeof(CacheHeader);
+    CacheHeader expected = MakeHeader(source_hash, Hash(payload, payload_size));
+    if (std::memcmp(data.data(), &expected, sizeof(expected))) {
+        return false;
+    }
+    try {
+        *forms = LoadImage(payload, payload_size, {});
+        return true;
+    } catch (const RuntimeError&) {
+        return false;
+    }
+}
+
+void WriteCache(const std::string& path, uint64_t source_hash, const std::vector<Object*>& forms) {
+    std::string payload = DumpImage(forms, {});
+    CacheHeader header = MakeHeader(source_hash, Hash(payload.data(), payload.size()));
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data += payload;
+    // Write to a temporary file of our own first, so concurrent readers never see a partial
+    // cache and concurrent writers don't write into each other's
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd < 0) {
+        return;
+    }
+    bool written = fchmod(fd, 0644) == 0;
+    for (size_t offset = 0; written && offset < data.size();) {
+        ssize_t count = write(fd, data.data() + offset, data.size() - offset);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        written = count > 0;
+        offset += written ? count : 0;
+    }
+    written = close(fd) == 0 && written;
+    if (!written || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+    }
+}
+
+}  // namespace
+
+std::string CachePathFor(const std::string& source_path) {
+    return source_path + ".cache";
+}
+
+std::vector<Object*> ReadSourceFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw RuntimeError{"Could not open source file '" + path + "'"};
+    }
+    std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    uint64_t source_hash = Hash(source.data(), source.size());
+
+    std::vector<Object*> forms;
+    if (ReadCache(CachePathFor(path), source_hash, &forms)) {
+        return forms;
+    }
+
+    std::stringstream ss(source);
+    Tokenizer tkn(&ss);
+    while (!tkn.IsEnd()) {
+        forms.push_back(Read(&tkn));
+    }
+    WriteCache(CachePathFor(path), source_hash, forms);
+    return forms;
+}
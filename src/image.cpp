@@ -0,0 +1,547 @@
+#include "image.h"
+#include "error.h"
+
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kImageMagic[8] = {'S', 'C', 'M', 'I', 'M', 'A', 'G', 'E'};
+const uint32_t kNilRef = 0xFFFFFFFF;
+
+enum class ImageTag : uint8_t { NUMBER, SYMBOL, BOOLEAN, CELL, SCOPE, LAMBDA, BUILTIN, VECTOR,
+                               HASH_TABLE, STRING, STRING_BUILDER, REAL,
+                               U8VECTOR, S64VECTOR, F64VECTOR, MEMOIZED, STRING_PORT,
+                               PROMISE };
+
+class ImageWriter {
+private:
+    const BuiltinNames& builtins_;
+    std::unordered_map<Object*, uint32_t> index_;
+    std::vector<Object*> order_;
+    std::string out_;
+
+    template <class T>
+    void Put(T value) {
+        out_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void PutString(const std::string& s) {
+        Put<uint32_t>(s.size());
+        out_ += s;
+    }
+
+    template <class T>
+    void PutElements(UniformVector<T>* vector) {
+        Put<uint32_t>(vector->Size());
+        out_.append(reinterpret_cast<const char*>(vector->Data()), vector->Size() * sizeof(T));
+    }
+
+    // A compiled case table is stored as the clause it replaced, and compiled again when
+    // the form is next evaluated
+    static Object* Stored(Object* obj) {
+        if (Is<FoldedForm>(obj)) {
+            return As<FoldedForm>(obj)->GetOriginal();
+        }
+        return Is<CaseTable>(obj) ? As<CaseTable>(obj)->GetSource() : obj;
+    }
+
+    uint32_t Enqueue(Object* obj) {
+        obj = Stored(obj);
+        if (obj == nullptr) {
+            return kNilRef;
+        }
+        auto it = index_.find(obj);
+        if (it != index_.end()) {
+            return it->second;
+        }
+        index_[obj] = order_.size();
+        order_.push_back(obj);
+        return order_.size() - 1;
+    }
+
+    void PutRef(Object* obj) {
+        Put<uint32_t>(obj == nullptr ? kNilRef : index_.at(Stored(obj)));
+    }
+
+    void Collect() {
+        // Breadth-first, so long lists do not recurse
+        for (size_t i = 0; i < order_.size(); ++i) {
+            Object* obj = order_[i];
+            if (Is<Cell>(obj)) {
+                Enqueue(As<Cell>(obj)->GetFirst());
+                Enqueue(As<Cell>(obj)->GetSecond());
+            } else if (Is<Scope>(obj)) {
+                Enqueue(As<Scope>(obj)->GetParent());
+                for (auto& x : As<Scope>(obj)->GetSymbols()) {
+                    Enqueue(x.second);
+                }
+            } else if (Is<Vector>(obj)) {
+                for (auto& x : As<Vector>(obj)->GetElements()) {
+                    Enqueue(x);
+                }
+            } else if (Is<HashTable>(obj)) {
+                for (auto& x : As<HashTable>(obj)->Entries()) {
+                    Enqueue(x.first);
+                    Enqueue(x.second);
+                }
+            } else if (Is<MemoizedFunction>(obj)) {
+                Enqueue(As<MemoizedFunction>(obj)->GetFunction());
+            } else if (Is<Promise>(obj)) {
+                Promise* promise = As<Promise>(obj);
+                Enqueue(promise->GetValue());
+                Enqueue(promise->GetExpr());
+                Enqueue(promise->GetScope());
+                Enqueue(promise->GetFunction());
+                for (auto& x : promise->GetArgs()) {
+                    Enqueue(x);
+                }
+            } else if (Is<LambdaImplFunction>(obj)) {
+                Enqueue(As<LambdaImplFunction>(obj)->GetScope());
+                for (auto& x : As<LambdaImplFunction>(obj)->GetBody()) {
+                    Enqueue(x);
+                }
+            }
+        }
+    }
+
+    void PutRecord(Object* obj) {
+        if (Is<Number>(obj)) {
+            Put(ImageTag::NUMBER);
+            Put<int64_t>(As<Number>(obj)->GetValue());
+        } else if (Is<Symbol>(obj)) {
+            Put(ImageTag::SYMBOL);
+            PutString(As<Symbol>(obj)->GetName());
+        } else if (Is<Boolean>(obj)) {
+            Put(ImageTag::BOOLEAN);
+            Put<uint8_t>(As<Boolean>(obj)->GetValue());
+        } else if (Is<Real>(obj)) {
+            Put(ImageTag::REAL);
+            Put<double>(As<Real>(obj)->GetValue());
+        } else if (Is<U8Vector>(obj)) {
+            Put(ImageTag::U8VECTOR);
+            PutElements(As<U8Vector>(obj));
+        } else if (Is<S64Vector>(obj)) {
+            Put(ImageTag::S64VECTOR);
+            PutElements(As<S64Vector>(obj));
+        } else if (Is<F64Vector>(obj)) {
+            Put(ImageTag::F64VECTOR);
+            PutElements(As<F64Vector>(obj));
+        } else if (Is<String>(obj)) {
+            Put(ImageTag::STRING);
+            PutString(As<String>(obj)->GetValue());
+        } else if (Is<StringBuilder>(obj)) {
+            Put(ImageTag::STRING_BUILDER);
+            PutString(As<StringBuilder>(obj)->GetValue());
+        } else if (Is<OutputPort>(obj) && As<OutputPort>(obj)->IsStringPort()) {
+            Put(ImageTag::STRING_PORT);
+            PutString(As<OutputPort>(obj)->GetString());
+        } else if (Is<Cell>(obj)) {
+            Put(ImageTag::CELL);
+            PutRef(As<Cell>(obj)->GetFirst());
+            PutRef(As<Cell>(obj)->GetSecond());
+        } else if (Is<Scope>(obj)) {
+            Scope* scope = As<Scope>(obj);
+            Put(ImageTag::SCOPE);
+            PutRef(scope->GetParent());
+            Put<uint32_t>(scope->GetSymbols().size());
+            for (auto& x : scope->GetSymbols()) {
+                PutString(x.first);
+                PutRef(x.second);
+            }
+        } else if (Is<Vector>(obj)) {
+            Put(ImageTag::VECTOR);
+            Put<uint32_t>(As<Vector>(obj)->Size());
+            for (auto& x : As<Vector>(obj)->GetElements()) {
+                PutRef(x);
+            }
+        } else if (Is<HashTable>(obj)) {
+            Put(ImageTag::HASH_TABLE);
+            auto entries = As<HashTable>(obj)->Entries();
+            Put<uint32_t>(entries.size());
+            for (auto& x : entries) {
+                PutRef(x.first);
+                PutRef(x.second);
+            }
+        } else if (Is<MemoizedFunction>(obj)) {
+            // The cached results are not stored
+            Put(ImageTag::MEMOIZED);
+            PutRef(As<MemoizedFunction>(obj)->GetFunction());
+            Put<uint64_t>(As<MemoizedFunction>(obj)->GetLimit());
+        } else if (Is<Promise>(obj)) {
+            Promise* promise = As<Promise>(obj);
+            Put(ImageTag::PROMISE);
+            Put<uint8_t>(promise->IsForced());
+            PutRef(promise->GetValue());
+            PutRef(promise->GetExpr());
+            PutRef(promise->GetScope());
+            PutRef(promise->GetFunction());
+            auto args = promise->GetArgs();
+            Put<uint32_t>(args.size());
+            for (auto& x : args) {
+                PutRef(x);
+            }
+        } else if (Is<LambdaImplFunction>(obj)) {
+            LambdaImplFunction* lambda = As<LambdaImplFunction>(obj);
+            Put(ImageTag::LAMBDA);
+            PutRef(lambda->GetScope());
+            Put<uint32_t>(lambda->GetArgs().size());
+            for (auto& x : lambda->GetArgs()) {
+                PutString(x);
+            }
+            Put<uint32_t>(lambda->GetBody().size());
+            for (auto& x : lambda->GetBody()) {
+                PutRef(x);
+            }
+        } else {
+            auto it = builtins_.find(obj);
+            if (it == builtins_.end()) {
+                throw RuntimeError{"Object can not be stored in an image"};
+            }
+            Put(ImageTag::BUILTIN);
+            PutString(it->second);
+        }
+    }
+
+public:
+    ImageWriter(const BuiltinNames& builtins) : builtins_(builtins) {
+    }
+
+    std::string Write(const std::vector<Object*>& roots) {
+        for (auto& x : roots) {
+            Enqueue(x);
+        }
+        Collect();
+        out_.append(kImageMagic, sizeof(kImageMagic));
+        Put<uint32_t>(kImageVersion);
+        Put<uint32_t>(order_.size());
+        Put<uint32_t>(roots.size());
+        for (auto& x : roots) {
+            PutRef(x);
+        }
+        for (auto& x : order_) {
+            PutRecord(x);
+        }
+        return std::move(out_);
+    }
+};
+
+class ImageReader {
+private:
+    const BuiltinTable& builtins_;
+    const char* cur_;
+    const char* end_;
+    std::vector<Object*> objs_;
+
+    // Records whose references can only be resolved once every object exists
+    std::vector<std::pair<Object*, const char*>> fixups_;
+
+    template <class T>
+    T Get() {
+        if (end_ - cur_ < static_cast<ptrdiff_t>(sizeof(T))) {
+            throw RuntimeError{"Corrupt image: unexpected end of data"};
+        }
+        T value;
+        std::memcpy(&value, cur_, sizeof(T));
+        cur_ += sizeof(T);
+        return value;
+    }
+
+    std::string GetString() {
+        uint32_t size = Get<uint32_t>();
+        if (static_cast<size_t>(end_ - cur_) < size) {
+            throw RuntimeError{"Corrupt image: unexpected end of data"};
+        }
+        std::string result(cur_, size);
+        cur_ += size;
+        return result;
+    }
+
+    template <class T>
+    UniformVector<T>* GetElements() {
+        uint32_t size = Get<uint32_t>();
+        if (static_cast<size_t>(end_ - cur_) / sizeof(T) < size) {
+            throw RuntimeError{"Corrupt image: unexpected end of data"};
+        }
+        std::vector<T> data(size);
+        std::memcpy(data.data(), cur_, size * sizeof(T));
+        cur_ += size * sizeof(T);
+        return Heap::Make<UniformVector<T>>(std::move(data));
+    }
+
+    Object* Resolve(uint32_t ref) {
+        if (ref == kNilRef) {
+            return nullptr;
+        }
+        if (ref >= objs_.size()) {
+            throw RuntimeError{"Corrupt image: dangling reference"};
+        }
+        return objs_[ref];
+    }
+
+    template <class T>
+    T* ResolveAs(uint32_t ref) {
+        Object* obj = Resolve(ref);
+        if (obj != nullptr && !Is<T>(obj)) {
+            throw RuntimeError{"Corrupt image: reference of a wrong type"};
+        }
+        return As<T>(obj);
+    }
+
+    void SkipRefs(uint32_t n) {
+        if (static_cast<size_t>(end_ - cur_) / sizeof(uint32_t) < n) {
+            throw RuntimeError{"Corrupt image: unexpected end of data"};
+        }
+        cur_ += n * sizeof(uint32_t);
+    }
+
+    Object* ReadRecord() {
+        ImageTag tag = Get<ImageTag>();
+        switch (tag) {
+            case ImageTag::NUMBER:
+                return Heap::Make<Number>(Get<int64_t>());
+            case ImageTag::SYMBOL:
+                return Heap::Make<Symbol>(GetString());
+            case ImageTag::BOOLEAN:
+                return Heap::Make<Boolean>(Get<uint8_t>() != 0);
+            case ImageTag::REAL:
+                return Heap::Make<Real>(Get<double>());
+            case ImageTag::U8VECTOR:
+                return GetElements<uint8_t>();
+            case ImageTag::S64VECTOR:
+                return GetElements<int64_t>();
+            case ImageTag::F64VECTOR:
+                return GetElements<double>();
+            case ImageTag::STRING:
+                return Heap::Make<String>(GetString());
+            case ImageTag::STRING_BUILDER: {
+                StringBuilder* builder = Heap::Make<StringBuilder>();
+                builder->Append(GetString());
+                return builder;
+            }
+            case ImageTag::STRING_PORT: {
+                OutputPort* port = Heap::Make<OutputPort>();
+                port->Write(GetString());
+                return port;
+            }
+            case ImageTag::CELL: {
+                Cell* cell = Heap::Make<Cell>();
+                fixups_.emplace_back(cell, cur_);
+                SkipRefs(2);
+                return cell;
+            }
+            case ImageTag::SCOPE: {
+                Scope* scope = Heap::Make<Scope>(nullptr);
+                fixups_.emplace_back(scope, cur_);
+                SkipRefs(1);
+                uint32_t n = Get<uint32_t>();
+                for (uint32_t i = 0; i < n; ++i) {
+                    GetString();
+                    SkipRefs(1);
+                }
+                return scope;
+            }
+            case ImageTag::LAMBDA: {
+                const char* start = cur_;
+                SkipRefs(1);
+                std::vector<std::string> args(Get<uint32_t>());
+                for (auto& x : args) {
+                    x = GetString();
+                }
+                uint32_t n = Get<uint32_t>();
+                SkipRefs(n);
+                LambdaImplFunction* lambda =
+                    Heap::Make<LambdaImplFunction>(args, std::vector<Object*>(n));
+                fixups_.emplace_back(lambda, start);
+                return lambda;
+            }
+            case ImageTag::MEMOIZED: {
+                const char* start = cur_;
+                SkipRefs(1);
+                MemoizedFunction* function = Heap::Make<MemoizedFunction>(nullptr, Get<uint64_t>());
+                fixups_.emplace_back(function, start);
+                return function;
+            }
+            case ImageTag::PROMISE: {
+                Promise* promise = Heap::Make<Promise>();
+                fixups_.emplace_back(promise, cur_);
+                Get<uint8_t>();
+                SkipRefs(4);
+                SkipRefs(Get<uint32_t>());
+                return promise;
+            }
+            case ImageTag::VECTOR: {
+                const char* start = cur_;
+                uint32_t n = Get<uint32_t>();
+                SkipRefs(n);
+                Vector* vector = Heap::Make<Vector>(std::vector<Object*>(n));
+                fixups_.emplace_back(vector, start);
+                return vector;
+            }
+            case ImageTag::HASH_TABLE: {
+                HashTable* table = Heap::Make<HashTable>();
+                fixups_.emplace_back(table, cur_);
+                SkipRefs(2 * Get<uint32_t>());
+                return table;
+            }
+            case ImageTag::BUILTIN: {
+                auto it = builtins_.find(GetString());
+                if (it == builtins_.end()) {
+                    throw RuntimeError{"Image refers to an unknown built-in function"};
+                }
+                return it->second;
+            }
+        }
+        throw RuntimeError{"Corrupt image: unknown record tag"};
+    }
+
+    void Relocate(Object* obj) {
+        if (Is<Cell>(obj)) {
+            As<Cell>(obj)->SetFirst(Resolve(Get<uint32_t>()));
+            As<Cell>(obj)->SetSecond(Resolve(Get<uint32_t>()));
+        } else if (Is<Scope>(obj)) {
+            Scope* scope = As<Scope>(obj);
+            scope->SetParent(ResolveAs<Scope>(Get<uint32_t>()));
+            uint32_t n = Get<uint32_t>();
+            for (uint32_t i = 0; i < n; ++i) {
+                std::string name = GetString();
+                scope->DefineSymbol(name, Resolve(Get<uint32_t>()));
+            }
+        } else if (Is<Vector>(obj)) {
+            Vector* vector = As<Vector>(obj);
+            uint32_t n = Get<uint32_t>();
+            for (uint32_t i = 0; i < n; ++i) {
+                vector->Set(i, Resolve(Get<uint32_t>()));
+            }
+        } else if (Is<HashTable>(obj)) {
+            HashTable* table = As<HashTable>(obj);
+            uint32_t n = Get<uint32_t>();
+            for (uint32_t i = 0; i < n; ++i) {
+                Object* key = Resolve(Get<uint32_t>());
+                table->Insert(key, Resolve(Get<uint32_t>()));
+            }
+        } else if (Is<MemoizedFunction>(obj)) {
+            SchemaFunction* function = ResolveAs<SchemaFunction>(Get<uint32_t>());
+            if (function == nullptr) {
+                throw RuntimeError{"Corrupt image: memoized procedure without a procedure"};
+            }
+            As<MemoizedFunction>(obj)->SetFunction(function);
+        } else if (Is<Promise>(obj)) {
+            bool forced = Get<uint8_t>();
+            Object* value = Resolve(Get<uint32_t>());
+            Object* expr = Resolve(Get<uint32_t>());
+            Scope* scope = ResolveAs<Scope>(Get<uint32_t>());
+            SchemaFunction* function = ResolveAs<SchemaFunction>(Get<uint32_t>());
+            std::vector<Object*> args(Get<uint32_t>());
+            for (auto& x : args) {
+                x = Resolve(Get<uint32_t>());
+            }
+            As<Promise>(obj)->Restore(forced, value, expr, scope, function, std::move(args));
+        } else if (Is<LambdaImplFunction>(obj)) {
+            LambdaImplFunction* lambda = As<LambdaImplFunction>(obj);
+            lambda->SetScope(ResolveAs<Scope>(Get<uint32_t>()));
+            uint32_t n = Get<uint32_t>();
+            for (uint32_t i = 0; i < n; ++i) {
+                GetString();
+            }
+            std::vector<Object*> body(Get<uint32_t>());
+            for (auto& x : body) {
+                x = Resolve(Get<uint32_t>());
+            }
+            lambda->SetBody(body);
+        }
+    }
+
+public:
+    ImageReader(const BuiltinTable& builtins) : builtins_(builtins) {
+    }
+
+    std::vector<Object*> Read(const char* data, size_t size) {
+        cur_ = data;
+        end_ = data + size;
+        if (size < sizeof(kImageMagic) || std::memcmp(data, kImageMagic, sizeof(kImageMagic))) {
+            throw RuntimeError{"Not an image"};
+        }
+        cur_ += sizeof(kImageMagic);
+        if (Get<uint32_t>() != kImageVersion) {
+            throw RuntimeError{"Image was written by an incompatible version"};
+        }
+        objs_.resize(Get<uint32_t>());
+        std::vector<uint32_t> root_refs(Get<uint32_t>());
+        for (auto& x : root_refs) {
+            x = Get<uint32_t>();
+        }
+        for (auto& x : objs_) {
+            x = ReadRecord();
+        }
+        // Hash tables go last: hashing a key needs the key itself relocated already
+        for (auto& x : fixups_) {
+            if (!Is<HashTable>(x.first)) {
+                cur_ = x.second;
+                Relocate(x.first);
+            }
+        }
+        for (auto& x : fixups_) {
+            if (Is<HashTable>(x.first)) {
+                cur_ = x.second;
+                Relocate(x.first);
+            }
+        }
+        std::vector<Object*> roots;
+        roots.reserve(root_refs.size());
+        for (auto& x : root_refs) {
+            roots.push_back(Resolve(x));
+        }
+        return roots;
+    }
+};
+
+}  // namespace
+
+std::string DumpImage(const std::vector<Object*>& roots, const BuiltinNames& builtins) {
+    return ImageWriter(builtins).Write(roots);
+}
+
+std::vector<Object*> LoadImage(const char* data, size_t size, const BuiltinTable& builtins) {
+    return ImageReader(builtins).Read(data, size);
+}
+
+void WriteImageFile(const std::string& path, const std::vector<Object*>& roots,
+                    const BuiltinNames& builtins) {
+    std::string image = DumpImage(roots, builtins);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    if (!out) {
+        throw RuntimeError{"Could not write image '" + path + "'"};
+    }
+}
+
+std::vector<Object*> ReadImageFile(const std::string& path, const BuiltinTable& builtins) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw RuntimeError{"Could not open image '" + path + "'"};
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw RuntimeError{"Could not read image '" + path + "'"};
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw RuntimeError{"Could not map image '" + path + "'"};
+    }
+    try {
+        auto roots = LoadImage(static_cast<const char*>(data), st.st_size, builtins);
+        munmap(data, st.st_size);
+        return roots;
+    } catch (...) {
+        munmap(data, st.st_size);
+        throw;
+    }
+}
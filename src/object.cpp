@@ -1,5 +1,21 @@
 #include "object.h"
 #include "error.h"
+#include "parser.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <shared_mutex>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 Object* Cell::GetFirst() const {
     return first_;
@@ -17,6 +33,18 @@ void Cell::SetSecond(Object* ptr) {
     second_ = ptr;
 }
 
+bool Cell::IsInterned() const {
+    return interned_;
+}
+
+bool Cell::IsFolded() const {
+    return folded_;
+}
+
+void Cell::SetFolded() {
+    folded_ = true;
+}
+
 bool Boolean::GetValue() const {
     return value_;
 }
@@ -31,6 +59,220 @@ const std::string& Symbol::GetName() const {
 Symbol::Symbol(const std::string& s) : name_(s) {
 }
 
+String::String(std::string value) : value_(std::move(value)) {
+}
+
+const std::string& String::GetValue() const {
+    return value_;
+}
+
+void StringBuilder::Append(const std::string& s) {
+    Heap::ChargeBytes(s.size());
+    buffer_ += s;
+}
+
+const std::string& StringBuilder::GetValue() const {
+    return buffer_;
+}
+
+namespace {
+
+// Output a port on a file descriptor gathers before writing it out
+const size_t kOutputBufferSize = 1 << 16;
+
+}  // namespace
+
+OutputPort::OutputPort() : fd_(-1) {
+}
+
+OutputPort::OutputPort(int fd) : fd_(fd) {
+    buffer_.reserve(kOutputBufferSize);
+}
+
+OutputPort::~OutputPort() {
+    Flush();
+}
+
+bool OutputPort::IsStringPort() const {
+    return fd_ < 0;
+}
+
+bool OutputPort::FlushLocked() {
+    if (IsStringPort()) {
+        return true;
+    }
+    size_t written = 0;
+    while (written < buffer_.size()) {
+        ssize_t n = ::write(fd_, buffer_.data() + written, buffer_.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    bool ok = written == buffer_.size();
+    buffer_.clear();
+    return ok;
+}
+
+void OutputPort::Write(std::string_view s) {
+    // What a string port gathers stays until get-output-string
+    if (IsStringPort()) {
+        Heap::ChargeBytes(s.size());
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer_ += s;
+    if (!IsStringPort() && buffer_.size() >= kOutputBufferSize && !FlushLocked()) {
+        throw RuntimeError{"Could not write the output"};
+    }
+}
+
+bool OutputPort::Flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return FlushLocked();
+}
+
+std::string OutputPort::GetString() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buffer_;
+}
+
+OutputPort* OutputPort::Stdout() {
+    // Never deleted, output written by the destructors of other statics still goes out
+    static OutputPort* port = [] {
+        std::atexit([] { OutputPort::Stdout()->Flush(); });
+        return new OutputPort(STDOUT_FILENO);
+    }();
+    return port;
+}
+
+EofObject* EofObject::Get() {
+    static EofObject* eof = new EofObject();
+    return eof;
+}
+
+namespace {
+
+// Input consumed before a port hands the pages behind it back to the kernel
+const size_t kReleaseInputEvery = 64 << 20;
+
+// Lets an istream, and so the Tokenizer, read a part of a mapping without copying it
+class MappedStreambuf : public std::streambuf {
+public:
+    MappedStreambuf(const char* begin, const char* end) {
+        char* data = const_cast<char*>(begin);
+        setg(data, data, data + (end - begin));
+    }
+
+protected:
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                             std::ios_base::openmode) override {
+        if (off != 0 || dir != std::ios_base::cur) {
+            return pos_type(off_type(-1));
+        }
+        return gptr() - eback();
+    }
+};
+
+}  // namespace
+
+InputPort::InputPort(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw RuntimeError{"Could not open file '" + path + "'"};
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw RuntimeError{"Could not open file '" + path + "'"};
+    }
+    size_ = st.st_size;
+    // An empty file can't be mapped, there is nothing to read either
+    if (size_ > 0) {
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw RuntimeError{"Could not map file '" + path + "'"};
+        }
+        madvise(data, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(data);
+    }
+    close(fd);
+}
+
+InputPort::~InputPort() {
+    Close();
+}
+
+void InputPort::RequireOpen() const {
+    if (!open_) {
+        throw RuntimeError{"Port is closed"};
+    }
+}
+
+void InputPort::Advance(size_t position) {
+    position_ = position;
+    if (position_ - released_ >= kReleaseInputEvery) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t end = position_ / page * page;
+        madvise(const_cast<char*>(data_) + released_, end - released_, MADV_DONTNEED);
+        released_ = end;
+    }
+}
+
+std::optional<std::string_view> InputPort::ReadLine() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RequireOpen();
+    if (position_ == size_) {
+        return std::nullopt;
+    }
+    const char* begin = data_ + position_;
+    const char* newline = static_cast<const char*>(memchr(begin, '\n', size_ - position_));
+    const char* end = newline != nullptr ? newline : data_ + size_;
+    Advance(end - data_ + (newline != nullptr));
+    if (end > begin && end[-1] == '\r') {
+        --end;
+    }
+    return std::string_view(begin, end - begin);
+}
+
+Object* InputPort::ReadDatum() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RequireOpen();
+    MappedStreambuf buffer(data_ + position_, data_ + size_);
+    std::istream in(&buffer);
+    Tokenizer tokenizer(&in);
+    if (tokenizer.IsEnd()) {
+        Advance(size_);
+        return EofObject::Get();
+    }
+    Token token = tokenizer.GetToken();
+    if (std::get_if<BracketToken>(&token) && *std::get_if<BracketToken>(&token) ==
+                                                 BracketToken::CLOSE) {
+        throw SyntaxError{"Unexpected closing bracket"};
+    }
+    Object* datum = Read(&tokenizer);
+    // The tokenizer has read a token past the datum, which is left for the next read
+    Advance(position_ + tokenizer.Consumed());
+    return datum;
+}
+
+void InputPort::Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (open_ && data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+    open_ = false;
+}
+
+Real::Real(double value) : value_(value) {
+}
+
+double Real::GetValue() const {
+    return value_;
+}
+
 int64_t Number::GetValue() const {
     return value_;
 }
@@ -112,6 +354,64 @@ bool Cell::BoarIterator::Advance() {
 }
 
 Object* Eval(Object* root, Scope* scope);
+void CountStep();
+
+// Limits of the Run in progress on this thread, for the tasks it starts, null without
+// limits. RunWithLimits runs a task under them on the calling thread, in place of whatever
+// limits the thread had, as a thread waiting for its own tasks may run those of others.
+struct TaskLimits;
+std::shared_ptr<TaskLimits> CurrentTaskLimits();
+void RunWithLimits(const std::shared_ptr<TaskLimits>& limits, const std::function<void()>& task);
+std::string Serialize(Object* root);
+std::string Display(Object* root);
+
+namespace {
+
+// Number of futures and parallel-map calls running anywhere in the process. Scopes are
+// only locked while it is non-zero, so single-threaded evaluation pays one atomic load.
+std::atomic<int> concurrent_evaluations{0};
+
+// Held while a concurrent evaluation starts and across ForkProcess, so none starts meanwhile
+std::mutex fork_mutex;
+
+void BeginConcurrentEvaluation() {
+    std::lock_guard<std::mutex> lock(fork_mutex);
+    concurrent_evaluations++;
+}
+
+// Scopes are locked through a small table of striped locks, which keeps them small
+std::shared_mutex scope_locks[64];
+
+class ScopeLock {
+private:
+    std::shared_mutex* mutex_ = nullptr;
+    bool exclusive_;
+
+public:
+    ScopeLock(const Scope* scope, bool exclusive) : exclusive_(exclusive) {
+        if (concurrent_evaluations.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+        mutex_ = &scope_locks[(reinterpret_cast<uintptr_t>(scope) >> 4) % 64];
+        if (exclusive_) {
+            mutex_->lock();
+        } else {
+            mutex_->lock_shared();
+        }
+    }
+
+    ~ScopeLock() {
+        if (mutex_ == nullptr) {
+            return;
+        } else if (exclusive_) {
+            mutex_->unlock();
+        } else {
+            mutex_->unlock_shared();
+        }
+    }
+};
+
+}  // namespace
 
 template <class Error = RuntimeError>
 void RequireNArgs(size_t n, const std::vector<Object*>& args) {
@@ -136,22 +436,6 @@ void RequireNotMoreNArgs(size_t n, const std::vector<Object*>& args) {
     }
 }
 
-Object* IsBooleanFunction::Invoke(const std::vector<Object*>& args) {
-    Object* evaled = Eval(args[0], CurrentScope::Get());
-    return Heap::Make<Boolean>(Is<Boolean>(evaled));
-}
-
-Object* NotFunction::Invoke(const std::vector<Object*>& args) {
-    RequireNArgs(1, args);
-    Object* evaled = Eval(args[0], CurrentScope::Get());
-    return Heap::Make<Boolean>(Is<Boolean>(evaled) ? !As<Boolean>(evaled)->GetValue() : false);
-}
-
-Object* IsNumberFunction::Invoke(const std::vector<Object*>& args) {
-    Object* evaled = Eval(args[0], CurrentScope::Get());
-    return Heap::Make<Boolean>(Is<Number>(evaled));
-}
-
 template <class Type>
 void RequireArgsAre(const std::vector<Object*>& args) {
     for (auto arg : args) {
@@ -161,167 +445,171 @@ void RequireArgsAre(const std::vector<Object*>& args) {
     }
 }
 
-Object* NumberEqFunction::Invoke(const std::vector<Object*>& args) {
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    for (size_t i = 1; i < evals.size(); ++i) {
-        if (As<Number>(evals[i - 1])->GetValue() != As<Number>(evals[i])->GetValue()) {
-            return Heap::Make<Boolean>(false);
-        }
+bool IsNumeric(Object* obj) {
+    return Is<Number>(obj) || Is<Real>(obj);
+}
+
+double ToDouble(Object* obj) {
+    if (Is<Number>(obj)) {
+        return As<Number>(obj)->GetValue();
     }
-    return Heap::Make<Boolean>(true);
+    return As<Real>(obj)->GetValue();
 }
 
-Object* NumberLeFunction::Invoke(const std::vector<Object*>& args) {
+namespace {
+
+// Arguments of the arithmetic builtins, evaluated and checked to be numbers
+std::vector<Object*> EvalNumbers(const std::vector<Object*>& args) {
     std::vector<Object*> evals(args.size());
     for (size_t i = 0; i < args.size(); ++i) {
         evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    for (size_t i = 1; i < evals.size(); ++i) {
-        if (As<Number>(evals[i - 1])->GetValue() >= As<Number>(evals[i])->GetValue()) {
-            return Heap::Make<Boolean>(false);
+        if (!IsNumeric(evals[i])) {
+            throw RuntimeError{"Wrong argument type"};
         }
     }
-    return Heap::Make<Boolean>(true);
+    return evals;
 }
 
-Object* NumberLeqFunction::Invoke(const std::vector<Object*>& args) {
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
+// An unboxed intermediate result: a fixnum until the first real operand, a flonum after
+struct Numeric {
+    bool exact = true;
+    int64_t fixnum = 0;
+    double flonum = 0;
+
+    static Numeric From(Object* obj) {
+        if (Is<Number>(obj)) {
+            return {true, As<Number>(obj)->GetValue(), 0};
+        }
+        return {false, 0, As<Real>(obj)->GetValue()};
     }
-    RequireArgsAre<Number>(evals);
-    for (size_t i = 1; i < evals.size(); ++i) {
-        if (As<Number>(evals[i - 1])->GetValue() > As<Number>(evals[i])->GetValue()) {
-            return Heap::Make<Boolean>(false);
+
+    static Numeric Inexact(double value) {
+        return {false, 0, value};
+    }
+
+    double AsDouble() const {
+        return exact ? fixnum : flonum;
+    }
+
+    Object* Box() const {
+        if (exact) {
+            return Heap::Make<Number>(fixnum);
         }
+        return Heap::Make<Real>(flonum);
     }
-    return Heap::Make<Boolean>(true);
+};
+
+// Folds the operands into the accumulator left to right. Fixnum pairs take the integer
+// path, and only the final result is boxed.
+template <class Op>
+Object* FoldNumbers(Numeric acc, const std::vector<Object*>& evals, size_t first, Op op) {
+    for (size_t i = first; i < evals.size(); ++i) {
+        if (acc.exact && Is<Number>(evals[i])) {
+            acc.fixnum = op(acc.fixnum, As<Number>(evals[i])->GetValue());
+        } else {
+            acc = Numeric::Inexact(op(acc.AsDouble(), ToDouble(evals[i])));
+        }
+    }
+    return acc.Box();
 }
 
-Object* NumberGeFunction::Invoke(const std::vector<Object*>& args) {
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
+template <class Compare>
+bool CompareNumbers(Object* a, Object* b, Compare compare) {
+    if (Is<Number>(a) && Is<Number>(b)) {
+        return compare(As<Number>(a)->GetValue(), As<Number>(b)->GetValue());
     }
-    RequireArgsAre<Number>(evals);
+    return compare(ToDouble(a), ToDouble(b));
+}
+
+// Checks that every adjacent pair of arguments is ordered by compare
+template <class Compare>
+Object* CompareChain(const std::vector<Object*>& args, Compare compare) {
+    std::vector<Object*> evals = EvalNumbers(args);
     for (size_t i = 1; i < evals.size(); ++i) {
-        if (As<Number>(evals[i - 1])->GetValue() <= As<Number>(evals[i])->GetValue()) {
+        if (!CompareNumbers(evals[i - 1], evals[i], compare)) {
             return Heap::Make<Boolean>(false);
         }
     }
     return Heap::Make<Boolean>(true);
 }
 
-Object* NumberGeqFunction::Invoke(const std::vector<Object*>& args) {
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    for (size_t i = 1; i < evals.size(); ++i) {
-        if (As<Number>(evals[i - 1])->GetValue() < As<Number>(evals[i])->GetValue()) {
-            return Heap::Make<Boolean>(false);
+// Exact when the division is, a real otherwise
+Numeric Divide(Numeric a, Object* b) {
+    if (a.exact && Is<Number>(b)) {
+        int64_t divisor = As<Number>(b)->GetValue();
+        if (divisor == 0) {
+            throw RuntimeError{"Division by zero"};
         }
+        if (!(a.fixnum == INT64_MIN && divisor == -1) && a.fixnum % divisor == 0) {
+            return {true, a.fixnum / divisor, 0};
+        }
+    } else if (Is<Number>(b) && As<Number>(b)->GetValue() == 0) {
+        throw RuntimeError{"Division by zero"};
     }
-    return Heap::Make<Boolean>(true);
+    return Numeric::Inexact(a.AsDouble() / ToDouble(b));
+}
+
+}  // namespace
+
+Object* NumberEqFunction::Invoke(const std::vector<Object*>& args) {
+    return CompareChain(args, std::equal_to<>());
+}
+
+Object* NumberLeFunction::Invoke(const std::vector<Object*>& args) {
+    return CompareChain(args, std::less<>());
+}
+
+Object* NumberLeqFunction::Invoke(const std::vector<Object*>& args) {
+    return CompareChain(args, std::less_equal<>());
+}
+
+Object* NumberGeFunction::Invoke(const std::vector<Object*>& args) {
+    return CompareChain(args, std::greater<>());
+}
+
+Object* NumberGeqFunction::Invoke(const std::vector<Object*>& args) {
+    return CompareChain(args, std::greater_equal<>());
 }
 
 Object* AddFunction::Invoke(const std::vector<Object*>& args) {
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    int64_t result = 0;
-    for (size_t i = 0; i < evals.size(); ++i) {
-        result += As<Number>(evals[i])->GetValue();
-    }
-    return Heap::Make<Number>(result);
+    return FoldNumbers(Numeric(), EvalNumbers(args), 0, std::plus<>());
 }
 
 Object* SubFunction::Invoke(const std::vector<Object*>& args) {
     RequireAtLeastNArgs(1, args);
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    int64_t result = As<Number>(evals[0])->GetValue();
-    for (size_t i = 1; i < evals.size(); ++i) {
-        result -= As<Number>(evals[i])->GetValue();
+    std::vector<Object*> evals = EvalNumbers(args);
+    if (evals.size() == 1) {
+        return FoldNumbers(Numeric(), evals, 0, std::minus<>());
     }
-    return Heap::Make<Number>(result);
+    return FoldNumbers(Numeric::From(evals[0]), evals, 1, std::minus<>());
 }
 
 Object* MulFunction::Invoke(const std::vector<Object*>& args) {
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    int64_t result = 1;
-    for (size_t i = 0; i < evals.size(); ++i) {
-        result *= As<Number>(evals[i])->GetValue();
-    }
-    return Heap::Make<Number>(result);
+    return FoldNumbers(Numeric{true, 1, 0}, EvalNumbers(args), 0, std::multiplies<>());
 }
 
 Object* DivFunction::Invoke(const std::vector<Object*>& args) {
     RequireAtLeastNArgs(1, args);
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
+    std::vector<Object*> evals = EvalNumbers(args);
+    Numeric result = evals.size() == 1 ? Numeric{true, 1, 0} : Numeric::From(evals[0]);
+    for (size_t i = evals.size() == 1 ? 0 : 1; i < evals.size(); ++i) {
+        result = Divide(result, evals[i]);
     }
-    RequireArgsAre<Number>(evals);
-    int64_t result = As<Number>(evals[0])->GetValue();
-    for (size_t i = 1; i < evals.size(); ++i) {
-        result /= As<Number>(evals[i])->GetValue();
-    }
-    return Heap::Make<Number>(result);
+    return result.Box();
 }
 
 Object* MinFunction::Invoke(const std::vector<Object*>& args) {
     RequireAtLeastNArgs(1, args);
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    int64_t result = As<Number>(evals[0])->GetValue();
-    for (size_t i = 1; i < evals.size(); ++i) {
-        result = std::min(result, As<Number>(evals[i])->GetValue());
-    }
-    return Heap::Make<Number>(result);
+    std::vector<Object*> evals = EvalNumbers(args);
+    return FoldNumbers(Numeric::From(evals[0]), evals, 1,
+                       [](auto a, auto b) { return std::min(a, b); });
 }
 
 Object* MaxFunction::Invoke(const std::vector<Object*>& args) {
     RequireAtLeastNArgs(1, args);
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    int64_t result = As<Number>(evals[0])->GetValue();
-    for (size_t i = 1; i < evals.size(); ++i) {
-        result = std::max(result, As<Number>(evals[i])->GetValue());
-    }
-    return Heap::Make<Number>(result);
-}
-
-Object* AbsFunction::Invoke(const std::vector<Object*>& args) {
-    RequireNArgs(1, args);
-    std::vector<Object*> evals(args.size());
-    for (size_t i = 0; i < args.size(); ++i) {
-        evals[i] = Eval(args[i], CurrentScope::Get());
-    }
-    RequireArgsAre<Number>(evals);
-    int64_t result = As<Number>(evals[0])->GetValue();
-    return Heap::Make<Number>(result < 0 ? -result : result);
+    std::vector<Object*> evals = EvalNumbers(args);
+    return FoldNumbers(Numeric::From(evals[0]), evals, 1,
+                       [](auto a, auto b) { return std::max(a, b); });
 }
 
 Object* QuoteFunction::Invoke(const std::vector<Object*>& args) {
@@ -361,22 +649,16 @@ Object* IsPairFunction::Invoke(const std::vector<Object*>& args) {
     if (!Is<Cell>(evaled)) {
         return Heap::Make<Boolean>(false);
     }
-    std::vector<Object*> els;
-    Cell::BoarIterator it = Cell::BoarIterator(As<Cell>(evaled));
-    els.push_back(it.Get());
-    while (it.Advance()) {
-        els.push_back(it.Get());
+    // Two elements, where an improper tail counts as one; counting stops past two
+    size_t count = 0;
+    ListWalker walker(evaled);
+    while (count <= 2 && walker.Next() != nullptr) {
+        ++count;
     }
-    if (els.back() == nullptr) {
-        els.pop_back();
+    if (walker.GetTail() != nullptr) {
+        ++count;
     }
-    return Heap::Make<Boolean>(els.size() == 2);
-}
-
-Object* IsNullFunction::Invoke(const std::vector<Object*>& args) {
-    RequireAtLeastNArgs(1, args);
-    Object* evaled = Eval(args[0], CurrentScope::Get());
-    return Heap::Make<Boolean>(evaled == nullptr);
+    return Heap::Make<Boolean>(count == 2);
 }
 
 bool IsProperList(Object* ptr);
@@ -388,16 +670,6 @@ Object* IsListFunction::Invoke(const std::vector<Object*>& args) {
     return Heap::Make<Boolean>(evaled == nullptr || IsProperList(evaled));
 }
 
-Object* ConsFunction::Invoke(const std::vector<Object*>& args) {
-    RequireAtLeastNArgs(2, args);
-    Object* evaled1 = Eval(args[0], CurrentScope::Get());
-    Object* evaled2 = Eval(args[1], CurrentScope::Get());
-    Cell* result = Heap::Make<Cell>();
-    result->SetFirst(evaled1);
-    result->SetSecond(evaled2);
-    return result;
-}
-
 template <class Type>
 void RequireIs(Object* arg) {
     if (!Is<Type>(arg)) {
@@ -405,20 +677,6 @@ void RequireIs(Object* arg) {
     }
 }
 
-Object* CarFunction::Invoke(const std::vector<Object*>& args) {
-    RequireAtLeastNArgs(1, args);
-    Object* evaled = Eval(args[0], CurrentScope::Get());
-    RequireIs<Cell>(evaled);
-    return As<Cell>(evaled)->GetFirst();
-}
-
-Object* CdrFunction::Invoke(const std::vector<Object*>& args) {
-    RequireAtLeastNArgs(1, args);
-    Object* evaled = Eval(args[0], CurrentScope::Get());
-    RequireIs<Cell>(evaled);
-    return As<Cell>(evaled)->GetSecond();
-}
-
 Object* MakeListFunction::Invoke(const std::vector<Object*>& args) {
     if (args.empty()) {
         return nullptr;
@@ -434,7 +692,7 @@ Object* MakeListFunction::Invoke(const std::vector<Object*>& args) {
         cur->SetSecond(Heap::Make<Cell>());
         cur = As<Cell>(cur->GetSecond());
     }
-    cur->SetFirst(args.back());
+    cur->SetFirst(evaled.back());
     return result;
 }
 
@@ -474,11 +732,46 @@ Object* ListRefFunction::Invoke(const std::vector<Object*>& args) {
     return result->GetFirst();
 }
 
-Object* IsSymbolFunction::Invoke(const std::vector<Object*>& args) {
-    RequireNArgs(1, args);
-    return Heap::Make<Boolean>(Is<Symbol>(Eval(args[0], CurrentScope::Get())));
+namespace {
+
+bool IsFoldable(Object* obj) {
+    return Is<SchemaFunction>(obj) && As<SchemaFunction>(obj)->IsFoldable();
+}
+
+// Rebinding a name from or to a foldable function invalidates the folds, which may rely
+// on it. owner is the scope that binds the name now, if any.
+void CheckRebinding(Scope* owner, const std::string& name, Object* value) {
+    if (IsFoldable(value) || (owner != nullptr && IsFoldable(owner->LookUpSymbol(name)))) {
+        CurrentScope::Get()->GetGlobal()->InvalidateFolding();
+    }
+}
+
+// The procedure of (define (name arg ...) body ...), whose name is stored in name
+LambdaImplFunction* MakeDefinedProcedure(const std::vector<Object*>& args, std::string* name) {
+    RequireAtLeastNArgs(2, args);
+    Cell::BoarIterator it(As<Cell>(args[0]));
+    std::vector<Object*> items;
+    items.push_back(it.Get());
+    while (it.Advance()) {
+        items.push_back(it.Get());
+    }
+    if (items.back() == nullptr) {
+        items.pop_back();
+    }
+    std::vector<std::string> params;
+    RequireIs<Symbol>(items[0]);
+    *name = As<Symbol>(items[0])->GetName();
+    for (size_t i = 1; i < items.size(); ++i) {
+        RequireIs<Symbol>(items[i]);
+        params.push_back(As<Symbol>(items[i])->GetName());
+    }
+    std::vector<Object*> body = args;
+    body.erase(body.begin());
+    return Heap::Make<LambdaImplFunction>(params, body);
 }
 
+}  // namespace
+
 Object* DefineFunction::Invoke(const std::vector<Object*>& args) {
     if (Is<Symbol>(args[0])) {
         RequireNArgs<SyntaxError>(2, args);
@@ -487,49 +780,49 @@ Object* DefineFunction::Invoke(const std::vector<Object*>& args) {
 
         RequireIs<Symbol>(eval1);
 
-        CurrentScope::Get()->DefineSymbol(As<Symbol>(eval1)->GetName(), eval2);
+        const std::string& name = As<Symbol>(eval1)->GetName();
+        CheckRebinding(CurrentScope::Get()->IsDefined(name), name, eval2);
+        CurrentScope::Get()->DefineSymbol(name, eval2);
         return nullptr;
     } else if (Is<Cell>(args[0])) {
-        RequireAtLeastNArgs(2, args);
-        Cell::BoarIterator it(As<Cell>(args[0]));
-        std::vector<Object*> items;
-        items.push_back(it.Get());
-        while (it.Advance()) {
-            items.push_back(it.Get());
-        }
-        if (items.back() == nullptr) {
-            items.pop_back();
-        }
         std::string name;
-        std::vector<std::string> params;
-        RequireIs<Symbol>(items[0]);
-        name = As<Symbol>(items[0])->GetName();
-        for (size_t i = 1; i < items.size(); ++i) {
-            RequireIs<Symbol>(items[i]);
-            params.push_back(As<Symbol>(items[i])->GetName());
-        }
-        std::vector<Object*> body = args;
-        body.erase(body.begin());
-        CurrentScope::Get()->DefineSymbol(name, Heap::Make<LambdaImplFunction>(params, body));
+        LambdaImplFunction* procedure = MakeDefinedProcedure(args, &name);
+        CheckRebinding(CurrentScope::Get()->IsDefined(name), name, procedure);
+        CurrentScope::Get()->DefineSymbol(name, procedure);
         return nullptr;
     } else {
         throw SyntaxError{"Invalid use of 'define'"};
     }
 }
 
-Object* IfFunction::Invoke(const std::vector<Object*>& args) {
-    RequireAtLeastNArgs<SyntaxError>(2, args);
-    RequireNotMoreNArgs<SyntaxError>(3, args);
+Object* DefineFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    // Folding may replace whole expressions of the body, which args still holds
+    if (!args.empty() && Is<Cell>(args[0]) && tail->call != nullptr &&
+        FoldConstants(tail->call)) {
+        return Invoke(ListToVector(tail->call->GetSecond()));
+    }
+    return Invoke(args);
+}
 
-    Object* eval1 = Eval(args[0], CurrentScope::Get());
+Object* DefineMemoizedFunction::Invoke(const std::vector<Object*>& args) {
+    RequireAtLeastNArgs<SyntaxError>(1, args);
+    if (!Is<Cell>(args[0])) {
+        throw SyntaxError{"Invalid use of 'define-memoized'"};
+    }
+    std::string name;
+    LambdaImplFunction* procedure = MakeDefinedProcedure(args, &name);
+    MemoizedFunction* memoized = Heap::Make<MemoizedFunction>(procedure, 0);
+    CheckRebinding(CurrentScope::Get()->IsDefined(name), name, memoized);
+    CurrentScope::Get()->DefineSymbol(name, memoized);
+    return nullptr;
+}
 
-    if (!(Is<Boolean>(eval1) && As<Boolean>(eval1)->GetValue() == false)) {
-        return Eval(args[1], CurrentScope::Get());
-    } else if (args.size() == 3) {
-        return Eval(args[2], CurrentScope::Get());
-    } else {
-        return nullptr;
+Object* DefineMemoizedFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    if (!args.empty() && Is<Cell>(args[0]) && tail->call != nullptr &&
+        FoldConstants(tail->call)) {
+        return Invoke(ListToVector(tail->call->GetSecond()));
     }
+    return Invoke(args);
 }
 
 Object* SetFunction::Invoke(const std::vector<Object*>& args) {
@@ -550,223 +843,2763 @@ Object* SetFunction::Invoke(const std::vector<Object*>& args) {
 
     RequireIs<Symbol>(eval1);
 
-    CurrentScope::Get()
-        ->IsDefined(As<Symbol>(eval1)->GetName())
-        ->DefineSymbol(As<Symbol>(eval1)->GetName(), eval2);
+    const std::string& name = As<Symbol>(eval1)->GetName();
+    Scope* owner = CurrentScope::Get()->IsDefined(name);
+    CheckRebinding(owner, name, eval2);
+    owner->DefineSymbol(name, eval2);
     return nullptr;
 }
 
-Object* SetCarFunction::Invoke(const std::vector<Object*>& args) {
-    RequireNArgs(2, args);
+ListWalker::ListWalker(Object* list) : next_(list), slow_(list) {
+}
 
-    Object* eval1 = Eval(args[0], CurrentScope::Get());
-    Object* eval2 = Eval(args[1], CurrentScope::Get());
+Cell* ListWalker::Next() {
+    if (cyclic_ || !Is<Cell>(next_)) {
+        return nullptr;
+    }
+    Cell* cell = As<Cell>(next_);
+    next_ = cell->GetSecond();
+    // The slow pointer moves at half the speed, the two meet only inside a cycle
+    if (odd_) {
+        slow_ = As<Cell>(slow_)->GetSecond();
+        cyclic_ = slow_ == next_;
+    }
+    odd_ = !odd_;
+    return cell;
+}
 
-    RequireIs<Cell>(eval1);
-    As<Cell>(eval1)->SetFirst(eval2);
-    return nullptr;
+Object* ListWalker::GetTail() const {
+    return next_;
 }
 
-Object* SetCdrFunction::Invoke(const std::vector<Object*>& args) {
-    RequireNArgs(2, args);
+bool ListWalker::IsCyclic() const {
+    return cyclic_;
+}
 
-    Object* eval1 = Eval(args[0], CurrentScope::Get());
-    Object* eval2 = Eval(args[1], CurrentScope::Get());
+void ListWalker::RequireProper() const {
+    if (next_ != nullptr) {
+        throw RuntimeError{cyclic_ ? "Expected a finite list" : "Expected a proper list"};
+    }
+}
 
-    RequireIs<Cell>(eval1);
-    As<Cell>(eval1)->SetSecond(eval2);
-    return nullptr;
+Cell* Cons(Object* first, Object* second) {
+    Cell* cell = Heap::Make<Cell>();
+    cell->SetFirst(first);
+    cell->SetSecond(second);
+    return cell;
 }
 
-Object* LambdaFunction::Invoke(const std::vector<Object*>& args) {
-    RequireAtLeastNArgs<SyntaxError>(2, args);
+std::vector<Object*> ListToVector(Object* list) {
+    std::vector<Object*> items;
+    ListWalker walker(list);
+    while (Cell* cell = walker.Next()) {
+        items.push_back(cell->GetFirst());
+    }
+    walker.RequireProper();
+    return items;
+}
 
-    std::vector<Object*> fmt_ptrs;
-    if (args[0] != nullptr) {
-        RequireIs<Cell>(args[0]);
-        Cell::BoarIterator it(As<Cell>(args[0]));
+Object* VectorToList(const std::vector<Object*>& items) {
+    Object* result = nullptr;
+    for (size_t i = items.size(); i > 0; --i) {
+        Cell* cell = Heap::Make<Cell>();
+        cell->SetFirst(items[i - 1]);
+        cell->SetSecond(result);
+        result = cell;
+    }
+    return result;
+}
 
-        fmt_ptrs.push_back(it.Get());
-        while (it.Advance()) {
-            fmt_ptrs.push_back(it.Get());
+namespace {
+
+// Builds a list front to back, appending at the tail
+class ListBuilder {
+private:
+    Object* head_ = nullptr;
+    Cell* tail_ = nullptr;
+
+public:
+    void Append(Object* value) {
+        Cell* cell = Heap::Make<Cell>();
+        cell->SetFirst(value);
+        if (tail_ == nullptr) {
+            head_ = cell;
+        } else {
+            tail_->SetSecond(cell);
         }
-        if (fmt_ptrs.back() == nullptr) {
-            fmt_ptrs.pop_back();
+        tail_ = cell;
+    }
+
+    Object* Get() const {
+        return head_;
+    }
+
+    // Ends the list with tail instead of the empty list
+    Object* Get(Object* tail) {
+        if (tail_ == nullptr) {
+            return tail;
         }
+        tail_->SetSecond(tail);
+        return head_;
+    }
+};
 
-        RequireArgsAre<Symbol>(fmt_ptrs);
+// Walks several lists in step, until the shortest one runs out
+class ListCursors {
+private:
+    std::vector<Object*> lists_;
+
+public:
+    explicit ListCursors(std::vector<Object*> lists) : lists_(std::move(lists)) {
     }
-    std::vector<Object*> body = args;
-    body.erase(body.begin());
 
-    std::vector<std::string> fmt;
-    fmt.reserve(fmt_ptrs.size());
-    for (auto& x : fmt_ptrs) {
-        fmt.push_back(As<Symbol>(x)->GetName());
+    // Replaces items with the next element of every list, returns false at the end
+    bool Next(std::vector<Object*>* items) {
+        items->resize(lists_.size());
+        for (size_t i = 0; i < lists_.size(); ++i) {
+            if (lists_[i] == nullptr) {
+                return false;
+            } else if (!Is<Cell>(lists_[i])) {
+                throw RuntimeError{"Expected a proper list"};
+            }
+        }
+        for (size_t i = 0; i < lists_.size(); ++i) {
+            (*items)[i] = As<Cell>(lists_[i])->GetFirst();
+            lists_[i] = As<Cell>(lists_[i])->GetSecond();
+        }
+        return true;
     }
+};
 
-    return Heap::Make<LambdaImplFunction>(fmt, body);
+bool IsTrue(Object* obj) {
+    return !(Is<Boolean>(obj) && !As<Boolean>(obj)->GetValue());
 }
 
-LambdaImplFunction::LambdaImplFunction(const std::vector<std::string>& fmt,
-                                       const std::vector<Object*>& cmds) {
-    args_fmt_ = fmt;
-    cmds_ = cmds;
-    lsc_ = Heap::Make<Scope>(CurrentScope::Get());
+// Evaluates the arguments of a list procedure, the first must be a function
+std::vector<Object*> EvalListProcedureArgs(const std::vector<Object*>& args, size_t min_args) {
+    RequireAtLeastNArgs(min_args, args);
+    std::vector<Object*> evals(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        evals[i] = Eval(args[i], CurrentScope::Get());
+    }
+    RequireIs<SchemaFunction>(evals[0]);
+    return evals;
 }
 
-Scope* LambdaImplFunction::GetScope() {
-    return lsc_;
+}  // namespace
+
+size_t ListLength(Object* list) {
+    size_t length = 0;
+    ListWalker walker(list);
+    while (walker.Next() != nullptr) {
+        ++length;
+    }
+    walker.RequireProper();
+    return length;
 }
 
-Object* LambdaImplFunction::Invoke(const std::vector<Object*>& args) {
-    Scope* safe_scope = Heap::Make<Scope>(lsc_);
-    RequireNArgs<RuntimeError>(args_fmt_.size(), args);
-    for (size_t i = 0; i < args.size(); ++i) {
-        auto h = Eval(args[i], CurrentScope::Get());
-        safe_scope->DefineSymbol(args_fmt_[i], h);
+Object* ReverseList(Object* list) {
+    Object* result = nullptr;
+    ListWalker walker(list);
+    while (Cell* cell = walker.Next()) {
+        result = Cons(cell->GetFirst(), result);
     }
+    walker.RequireProper();
+    return result;
+}
 
-    Object* last_eval = nullptr;
-    for (auto& x : cmds_) {
-        last_eval = Eval(x, safe_scope);
+Object* AppendLists(const std::vector<Object*>& lists) {
+    if (lists.empty()) {
+        return nullptr;
     }
+    ListBuilder result;
+    for (size_t i = 0; i + 1 < lists.size(); ++i) {
+        ListWalker walker(lists[i]);
+        while (Cell* cell = walker.Next()) {
+            result.Append(cell->GetFirst());
+        }
+        walker.RequireProper();
+    }
+    return result.Get(lists.back());
+}
 
-    return last_eval;
+Object* CopyList(Object* list) {
+    ListBuilder result;
+    ListWalker walker(list);
+    while (Cell* cell = walker.Next()) {
+        result.Append(cell->GetFirst());
+    }
+    if (walker.IsCyclic()) {
+        throw RuntimeError{"Expected a finite list"};
+    }
+    return result.Get(walker.GetTail());
 }
 
-Scope::Scope(Scope* parent) : parent_(parent) {
+Cell* LastPair(Object* list) {
+    Cell* last = nullptr;
+    ListWalker walker(list);
+    while (Cell* cell = walker.Next()) {
+        last = cell;
+    }
+    if (last == nullptr) {
+        throw RuntimeError{"Expected a pair"};
+    } else if (walker.IsCyclic()) {
+        throw RuntimeError{"Expected a finite list"};
+    }
+    return last;
 }
 
-void Scope::DefineSymbol(const std::string& symbol, Object* obj) {
-    known_symbols_[symbol] = obj;
+Object* Member(Object* obj, Object* list, bool (*same)(Object*, Object*)) {
+    ListWalker walker(list);
+    while (Cell* cell = walker.Next()) {
+        if (same(obj, cell->GetFirst())) {
+            return cell;
+        }
+    }
+    walker.RequireProper();
+    return Heap::Make<Boolean>(false);
 }
 
-Object* Scope::LookUpSymbol(const std::string& symbol) {
-    Scope* current = this;
-    while (current != nullptr && current->known_symbols_.find(symbol) == known_symbols_.end()) {
-        current = current->parent_;
+Object* Assoc(Object* obj, Object* alist, bool (*same)(Object*, Object*)) {
+    ListWalker walker(alist);
+    while (Cell* cell = walker.Next()) {
+        if (!Is<Cell>(cell->GetFirst())) {
+            throw RuntimeError{"Expected a list of pairs"};
+        }
+        if (same(obj, As<Cell>(cell->GetFirst())->GetFirst())) {
+            return cell->GetFirst();
+        }
     }
-    if (current == nullptr) {
-        throw NameError{std::string() + "Reference to an unknown symbol '" + symbol + "'"};
-    } else {
-        return current->known_symbols_[symbol];
+    walker.RequireProper();
+    return Heap::Make<Boolean>(false);
+}
+
+Object* AppendFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> lists(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        lists[i] = Eval(args[i], CurrentScope::Get());
     }
+    return AppendLists(lists);
 }
 
-Scope* Scope::IsDefined(const std::string& symbol) {
-    Scope* current = this;
-    while (current != nullptr && current->known_symbols_.find(symbol) == known_symbols_.end()) {
-        current = current->parent_;
+Object* MapFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> evals = EvalListProcedureArgs(args, 2);
+    SchemaFunction* function = As<SchemaFunction>(evals[0]);
+    ListCursors cursors(std::vector<Object*>(evals.begin() + 1, evals.end()));
+    ListBuilder result;
+    std::vector<Object*> items;
+    while (cursors.Next(&items)) {
+        result.Append(function->Apply(items));
     }
-    return current;
+    return result.Get();
 }
 
-Scope* Scope::GetParent() {
-    return parent_;
+Object* ForEachFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> evals = EvalListProcedureArgs(args, 2);
+    SchemaFunction* function = As<SchemaFunction>(evals[0]);
+    ListCursors cursors(std::vector<Object*>(evals.begin() + 1, evals.end()));
+    std::vector<Object*> items;
+    while (cursors.Next(&items)) {
+        function->Apply(items);
+    }
+    return nullptr;
 }
 
-CurrentScope::CurrentScope() {
+Object* FilterFunction::Invoke(const std::vector<Object*>& args) {
+    RequireNArgs(2, args);
+    std::vector<Object*> evals = EvalListProcedureArgs(args, 2);
+    SchemaFunction* predicate = As<SchemaFunction>(evals[0]);
+    ListCursors cursors({evals[1]});
+    ListBuilder result;
+    std::vector<Object*> items;
+    while (cursors.Next(&items)) {
+        if (IsTrue(predicate->Apply(items))) {
+            result.Append(items[0]);
+        }
+    }
+    return result.Get();
+}
+
+Object* FoldLeftFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> evals = EvalListProcedureArgs(args, 3);
+    SchemaFunction* function = As<SchemaFunction>(evals[0]);
+    ListCursors cursors(std::vector<Object*>(evals.begin() + 2, evals.end()));
+    Object* acc = evals[1];
+    std::vector<Object*> items;
+    std::vector<Object*> call_args;
+    while (cursors.Next(&items)) {
+        call_args.assign(1, acc);
+        call_args.insert(call_args.end(), items.begin(), items.end());
+        acc = function->Apply(call_args);
+    }
+    return acc;
+}
+
+Object* FoldRightFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> evals = EvalListProcedureArgs(args, 3);
+    SchemaFunction* function = As<SchemaFunction>(evals[0]);
+    ListCursors cursors(std::vector<Object*>(evals.begin() + 2, evals.end()));
+    // Folding from the right needs the elements in reverse, so they are collected first
+    std::vector<std::vector<Object*>> rows;
+    std::vector<Object*> items;
+    while (cursors.Next(&items)) {
+        rows.push_back(items);
+    }
+    Object* acc = evals[1];
+    for (size_t i = rows.size(); i > 0; --i) {
+        rows[i - 1].push_back(acc);
+        acc = function->Apply(rows[i - 1]);
+    }
+    return acc;
 }
 
-void CurrentScope::Set(Scope* new_scope) {
-    Instance().ptr_ = new_scope;
+Object* ReduceFunction::Invoke(const std::vector<Object*>& args) {
+    RequireNArgs(3, args);
+    std::vector<Object*> evals = EvalListProcedureArgs(args, 3);
+    SchemaFunction* function = As<SchemaFunction>(evals[0]);
+    ListCursors cursors({evals[2]});
+    std::vector<Object*> items;
+    if (!cursors.Next(&items)) {
+        return evals[1];
+    }
+    Object* acc = items[0];
+    while (cursors.Next(&items)) {
+        acc = function->Apply({items[0], acc});
+    }
+    return acc;
 }
 
-Scope* CurrentScope::Get() {
-    return Instance().ptr_;
+Object* ApplyFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> evals = EvalListProcedureArgs(args, 2);
+    // (apply f a b rest) calls f with a, b and the elements of rest
+    std::vector<Object*> values(evals.begin() + 1, evals.end() - 1);
+    for (Object* list = evals.back(); list != nullptr; list = As<Cell>(list)->GetSecond()) {
+        if (!Is<Cell>(list)) {
+            throw RuntimeError{"Expected a proper list"};
+        }
+        values.push_back(As<Cell>(list)->GetFirst());
+    }
+    return As<SchemaFunction>(evals[0])->Apply(values);
 }
 
-CurrentScope& CurrentScope::Instance() {
-    static CurrentScope sc;
-    return sc;
+Vector::Vector(std::vector<Object*> elements) : elements_(std::move(elements)) {
 }
 
-Heap::Heap() {
+size_t Vector::CheckIndex(int64_t index) const {
+    if (index < 0 || static_cast<uint64_t>(index) >= elements_.size()) {
+        throw RuntimeError{"Vector index out of range"};
+    }
+    return index;
 }
 
-Heap& Heap::Instance() {
-    static Heap hp;
-    return hp;
+size_t Vector::Size() const {
+    return elements_.size();
 }
 
-void Number::Mark() {
-    marked_ = true;
+Object* Vector::Get(int64_t index) const {
+    return elements_[CheckIndex(index)];
 }
 
-void Symbol::Mark() {
-    marked_ = true;
+void Vector::Set(int64_t index, Object* value) {
+    elements_[CheckIndex(index)] = value;
 }
 
-void Boolean::Mark() {
-    marked_ = true;
+void Vector::Fill(Object* value) {
+    std::fill(elements_.begin(), elements_.end(), value);
 }
 
-void Cell::Mark() {
-    if (!marked_) {
-        marked_ = true;
-        if (first_ != nullptr) {
-            first_->Mark();
+const std::vector<Object*>& Vector::GetElements() const {
+    return elements_;
+}
+
+Object* MakeVectorFunction::Invoke(const std::vector<Object*>& args) {
+    RequireAtLeastNArgs(1, args);
+    RequireNotMoreNArgs(2, args);
+    Object* size = Eval(args[0], CurrentScope::Get());
+    RequireIs<Number>(size);
+    if (As<Number>(size)->GetValue() < 0) {
+        throw RuntimeError{"Vector size must not be negative"};
+    } else if (uint64_t(As<Number>(size)->GetValue()) > kMaxVectorBytes / sizeof(Object*)) {
+        throw RuntimeError{"Vector size is too large"};
+    }
+    Object* fill = args.size() == 2 ? Eval(args[1], CurrentScope::Get()) : nullptr;
+    Heap::ChargeElements(As<Number>(size)->GetValue());
+    return Heap::Make<Vector>(std::vector<Object*>(As<Number>(size)->GetValue(), fill));
+}
+
+Object* VectorFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> elements(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        elements[i] = Eval(args[i], CurrentScope::Get());
+    }
+    return Heap::Make<Vector>(std::move(elements));
+}
+
+namespace {
+
+// Bitwise, so reals compare like eqv? does
+template <class T>
+bool SameElements(UniformVector<T>* a, UniformVector<T>* b) {
+    return a->Size() == b->Size() && std::memcmp(a->Data(), b->Data(), a->Size() * sizeof(T)) == 0;
+}
+
+template <class T>
+uint64_t HashElements(UniformVector<T>* vector) {
+    size_t bytes = std::min<size_t>(vector->Size() * sizeof(T), 256);
+    std::string_view prefix(reinterpret_cast<const char*>(vector->Data()), bytes);
+    return std::hash<std::string_view>()(prefix) ^ vector->Size();
+}
+
+}  // namespace
+
+bool IsEq(Object* a, Object* b) {
+    if (a == b) {
+        return true;
+    } else if (Is<Number>(a) && Is<Number>(b)) {
+        return As<Number>(a)->GetValue() == As<Number>(b)->GetValue();
+    } else if (Is<Symbol>(a) && Is<Symbol>(b)) {
+        return As<Symbol>(a)->GetName() == As<Symbol>(b)->GetName();
+    } else if (Is<Boolean>(a) && Is<Boolean>(b)) {
+        return As<Boolean>(a)->GetValue() == As<Boolean>(b)->GetValue();
+    }
+    return false;
+}
+
+bool IsEqv(Object* a, Object* b) {
+    if (Is<Real>(a) && Is<Real>(b)) {
+        double x = As<Real>(a)->GetValue();
+        double y = As<Real>(b)->GetValue();
+        return std::memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return IsEq(a, b);
+}
+
+namespace {
+
+struct PairHash {
+    size_t operator()(const std::pair<Object*, Object*>& p) const {
+        return std::hash<Object*>()(p.first) * 31 + std::hash<Object*>()(p.second);
+    }
+};
+
+// Compound pairs compared before IsEqual starts to remember them, which only circular
+// structures (or very large ones) ever reach
+const size_t kComparisonsBeforeTracking = 1 << 16;
+
+}  // namespace
+
+bool IsEqual(Object* a, Object* b) {
+    // Compound objects push their parts instead of recursing, long lists are common
+    std::vector<std::pair<Object*, Object*>> pending{{a, b}};
+    // Pairs of compound objects already compared or being compared. Meeting one again
+    // means it is equal unless something else differs, which ends the walk of a cycle.
+    std::unordered_set<std::pair<Object*, Object*>, PairHash> seen;
+    size_t compared = 0;
+    while (!pending.empty()) {
+        auto [x, y] = pending.back();
+        pending.pop_back();
+        if (x == y) {
+            continue;
+        } else if ((Is<Cell>(x) || Is<Vector>(x)) && ++compared > kComparisonsBeforeTracking &&
+                   !seen.emplace(x, y).second) {
+            continue;
+        } else if (x == nullptr || y == nullptr) {
+            return false;
+        } else if (Is<Number>(x) && Is<Number>(y)) {
+            if (As<Number>(x)->GetValue() != As<Number>(y)->GetValue()) {
+                return false;
+            }
+        } else if (Is<Symbol>(x) && Is<Symbol>(y)) {
+            if (As<Symbol>(x)->GetName() != As<Symbol>(y)->GetName()) {
+                return false;
+            }
+        } else if (Is<Boolean>(x) && Is<Boolean>(y)) {
+            if (As<Boolean>(x)->GetValue() != As<Boolean>(y)->GetValue()) {
+                return false;
+            }
+        } else if (Is<Real>(x) && Is<Real>(y)) {
+            // Bitwise, as eqv?: 0.0 and -0.0 differ and NaN is equal to itself
+            double a = As<Real>(x)->GetValue();
+            double b = As<Real>(y)->GetValue();
+            if (std::memcmp(&a, &b, sizeof(double)) != 0) {
+                return false;
+            }
+        } else if (Is<String>(x) && Is<String>(y)) {
+            if (As<String>(x)->GetValue() != As<String>(y)->GetValue()) {
+                return false;
+            }
+        } else if (Is<Cell>(x) && Is<Cell>(y)) {
+            pending.emplace_back(As<Cell>(x)->GetSecond(), As<Cell>(y)->GetSecond());
+            pending.emplace_back(As<Cell>(x)->GetFirst(), As<Cell>(y)->GetFirst());
+        } else if (Is<U8Vector>(x) && Is<U8Vector>(y)) {
+            if (!SameElements(As<U8Vector>(x), As<U8Vector>(y))) {
+                return false;
+            }
+        } else if (Is<S64Vector>(x) && Is<S64Vector>(y)) {
+            if (!SameElements(As<S64Vector>(x), As<S64Vector>(y))) {
+                return false;
+            }
+        } else if (Is<F64Vector>(x) && Is<F64Vector>(y)) {
+            if (!SameElements(As<F64Vector>(x), As<F64Vector>(y))) {
+                return false;
+            }
+        } else if (Is<Vector>(x) && Is<Vector>(y)) {
+            auto& xs = As<Vector>(x)->GetElements();
+            auto& ys = As<Vector>(y)->GetElements();
+            if (xs.size() != ys.size()) {
+                return false;
+            }
+            for (size_t i = xs.size(); i > 0; --i) {
+                pending.emplace_back(xs[i - 1], ys[i - 1]);
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+namespace {
+
+uint64_t MixHash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Hashes compound objects only up to a budget of parts, so hashing stays cheap and bounded
+uint64_t HashBounded(Object* obj, int* budget) {
+    if (--*budget < 0 || obj == nullptr) {
+        return 0;
+    } else if (Is<Number>(obj)) {
+        return MixHash(As<Number>(obj)->GetValue());
+    } else if (Is<Symbol>(obj)) {
+        return std::hash<std::string>()(As<Symbol>(obj)->GetName());
+    } else if (Is<Boolean>(obj)) {
+        return As<Boolean>(obj)->GetValue() ? 0x9e3779b97f4a7c15ULL : 0x7f4a7c159e3779b9ULL;
+    } else if (Is<Real>(obj)) {
+        double value = As<Real>(obj)->GetValue();
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return MixHash(bits ^ 0x5bd1e995ULL);
+    } else if (Is<String>(obj)) {
+        return MixHash(std::hash<std::string>()(As<String>(obj)->GetValue()));
+    } else if (Is<Cell>(obj)) {
+        uint64_t h = 0xc3a5c85c97cb3127ULL;
+        while (Is<Cell>(obj) && *budget > 0) {
+            h = MixHash(h * 31 + HashBounded(As<Cell>(obj)->GetFirst(), budget));
+            obj = As<Cell>(obj)->GetSecond();
         }
-        if (second_ != nullptr) {
-            second_->Mark();
+        return obj == nullptr || Is<Cell>(obj) ? h : MixHash(h * 31 + HashBounded(obj, budget));
+    } else if (Is<U8Vector>(obj)) {
+        return MixHash(HashElements(As<U8Vector>(obj)));
+    } else if (Is<S64Vector>(obj)) {
+        return MixHash(HashElements(As<S64Vector>(obj)));
+    } else if (Is<F64Vector>(obj)) {
+        return MixHash(HashElements(As<F64Vector>(obj)));
+    } else if (Is<Vector>(obj)) {
+        uint64_t h = MixHash(As<Vector>(obj)->Size());
+        for (auto& x : As<Vector>(obj)->GetElements()) {
+            if (*budget <= 0) {
+                break;
+            }
+            h = MixHash(h * 31 + HashBounded(x, budget));
         }
+        return h;
+    } else {
+        return MixHash(reinterpret_cast<uintptr_t>(obj));
     }
 }
 
-void SchemaFunction::Mark() {
-    marked_ = true;
+}  // namespace
+
+uint64_t Hash(Object* obj) {
+    int budget = 32;
+    return HashBounded(obj, &budget);
 }
 
-void Scope::Mark() {
-    if (!marked_) {
-        marked_ = true;
-        for (auto& x : known_symbols_) {
-            x.second->Mark();
+HashTable::HashTable() : slots_(8) {
+}
+
+size_t HashTable::FindSlot(Object* key, uint64_t hash) const {
+    size_t mask = slots_.size() - 1;
+    size_t free_slot = SIZE_MAX;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const Slot& slot = slots_[i];
+        if (slot.state == SlotState::EMPTY) {
+            return free_slot == SIZE_MAX ? i : free_slot;
+        } else if (slot.state == SlotState::DELETED) {
+            if (free_slot == SIZE_MAX) {
+                free_slot = i;
+            }
+        } else if (slot.hash == hash && IsEqual(slot.key, key)) {
+            return i;
         }
-        if (parent_ != nullptr) {
-            parent_->Mark();
+    }
+}
+
+void HashTable::Rehash(size_t capacity) {
+    std::vector<Slot> old(capacity);
+    old.swap(slots_);
+    used_ = count_;
+    for (auto& x : old) {
+        if (x.state == SlotState::FULL) {
+            size_t i = x.hash & (slots_.size() - 1);
+            while (slots_[i].state != SlotState::EMPTY) {
+                i = (i + 1) & (slots_.size() - 1);
+            }
+            slots_[i] = x;
         }
     }
 }
 
-void LambdaImplFunction::Mark() {
-    if (!marked_) {
-        marked_ = true;
-        for (auto& x : cmds_) {
-            x->Mark();
+bool HashTable::Lookup(Object* key, Object** value) const {
+    const Slot& slot = slots_[FindSlot(key, Hash(key))];
+    if (slot.state != SlotState::FULL) {
+        return false;
+    }
+    *value = slot.value;
+    return true;
+}
+
+void HashTable::Insert(Object* key, Object* value) {
+    uint64_t hash = Hash(key);
+    size_t i = FindSlot(key, hash);
+    if (slots_[i].state == SlotState::FULL) {
+        slots_[i].value = value;
+        return;
+    }
+    // Keep the load, tombstones included, under 3/4
+    if (slots_[i].state == SlotState::EMPTY && (used_ + 1) * 4 > slots_.size() * 3) {
+        size_t capacity = slots_.size();
+        while ((count_ + 1) * 2 > capacity) {
+            capacity *= 2;
         }
-        lsc_->Mark();
+        Rehash(capacity);
+        i = FindSlot(key, hash);
     }
+    if (slots_[i].state == SlotState::EMPTY) {
+        ++used_;
+    }
+    slots_[i] = Slot{SlotState::FULL, hash, key, value};
+    ++count_;
 }
 
-void Object::UnMark() {
-    marked_ = false;
+bool HashTable::Remove(Object* key) {
+    Slot& slot = slots_[FindSlot(key, Hash(key))];
+    if (slot.state != SlotState::FULL) {
+        return false;
+    }
+    slot = Slot{SlotState::DELETED, 0, nullptr, nullptr};
+    --count_;
+    return true;
 }
 
-bool Object::IsMarked() {
-    return marked_;
+size_t HashTable::Count() const {
+    return count_;
 }
 
-void Heap::Cleanup(Scope* global_scope) {
-    for (auto& x : Instance().objs_) {
-        x->UnMark();
+std::vector<std::pair<Object*, Object*>> HashTable::Entries() const {
+    std::vector<std::pair<Object*, Object*>> result;
+    result.reserve(count_);
+    for (auto& x : slots_) {
+        if (x.state == SlotState::FULL) {
+            result.emplace_back(x.key, x.value);
+        }
     }
-    global_scope->Mark();
-    std::vector<Object*> new_objs;
-    for (auto& x : Instance().objs_) {
-        if (!x->IsMarked()) {
-            delete x;
-        } else {
-            new_objs.push_back(x);
+    return result;
+}
+
+Object* SubstringFunction::Invoke(const std::vector<Object*>& args) {
+    RequireAtLeastNArgs(2, args);
+    RequireNotMoreNArgs(3, args);
+    std::vector<Object*> evals(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        evals[i] = Eval(args[i], CurrentScope::Get());
+    }
+    RequireIs<String>(evals[0]);
+    const std::string& value = As<String>(evals[0])->GetValue();
+    RequireIs<Number>(evals[1]);
+    int64_t start = As<Number>(evals[1])->GetValue();
+    int64_t end = value.size();
+    if (evals.size() == 3) {
+        RequireIs<Number>(evals[2]);
+        end = As<Number>(evals[2])->GetValue();
+    }
+    if (start < 0 || start > end || end > static_cast<int64_t>(value.size())) {
+        throw RuntimeError{"Substring bounds out of range"};
+    }
+    return Heap::Make<String>(value.substr(start, end - start));
+}
+
+Object* StringAppendFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> evals(args.size());
+    size_t size = 0;
+    for (size_t i = 0; i < args.size(); ++i) {
+        evals[i] = Eval(args[i], CurrentScope::Get());
+        RequireIs<String>(evals[i]);
+        size += As<String>(evals[i])->GetValue().size();
+    }
+    std::string result;
+    result.reserve(size);
+    for (auto& x : evals) {
+        result += As<String>(x)->GetValue();
+    }
+    return Heap::Make<String>(std::move(result));
+}
+
+namespace {
+
+// Evaluates the arguments of an output procedure, the last of which is an optional port
+OutputPort* EvalPortArgs(const std::vector<Object*>& args, size_t required,
+                         std::vector<Object*>* values) {
+    RequireAtLeastNArgs(required, args);
+    RequireNotMoreNArgs(required + 1, args);
+    for (size_t i = 0; i < required; ++i) {
+        values->push_back(Eval(args[i], CurrentScope::Get()));
+    }
+    if (args.size() == required) {
+        return OutputPort::Stdout();
+    }
+    Object* port = Eval(args[required], CurrentScope::Get());
+    RequireIs<OutputPort>(port);
+    return As<OutputPort>(port);
+}
+
+}  // namespace
+
+Object* DisplayFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> values;
+    OutputPort* port = EvalPortArgs(args, 1, &values);
+    port->Write(Display(values[0]));
+    return nullptr;
+}
+
+Object* WriteFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> values;
+    OutputPort* port = EvalPortArgs(args, 1, &values);
+    port->Write(Serialize(values[0]));
+    return nullptr;
+}
+
+Object* NewlineFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> values;
+    EvalPortArgs(args, 0, &values)->Write("\n");
+    return nullptr;
+}
+
+Object* FlushOutputFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> values;
+    if (!EvalPortArgs(args, 0, &values)->Flush()) {
+        throw RuntimeError{"Could not write the output"};
+    }
+    return nullptr;
+}
+
+Object* HashTableRefFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> values(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        values[i] = Eval(args[i], CurrentScope::Get());
+    }
+    return Apply(values);
+}
+
+Object* HashTableRefFunction::Apply(const std::vector<Object*>& values) {
+    RequireAtLeastNArgs(2, values);
+    RequireNotMoreNArgs(3, values);
+    RequireIs<HashTable>(values[0]);
+    Object* value = nullptr;
+    if (As<HashTable>(values[0])->Lookup(values[1], &value)) {
+        return value;
+    } else if (values.size() == 3) {
+        RequireIs<SchemaFunction>(values[2]);
+        return As<SchemaFunction>(values[2])->Apply({});
+    }
+    throw RuntimeError{"Key is not in the hash table"};
+}
+
+size_t MemoizedFunction::ArgsHash::operator()(const std::vector<Object*>* args) const {
+    uint64_t h = args->size();
+    for (auto& x : *args) {
+        h = MixHash(h * 31 + Hash(x));
+    }
+    return h;
+}
+
+bool MemoizedFunction::ArgsEqual::operator()(const std::vector<Object*>* a,
+                                             const std::vector<Object*>* b) const {
+    if (a->size() != b->size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a->size(); ++i) {
+        if (!IsEqual((*a)[i], (*b)[i])) {
+            return false;
         }
     }
-    Instance().objs_ = new_objs;
+    return true;
 }
 
-Heap::~Heap() {
+MemoizedFunction::MemoizedFunction(SchemaFunction* function, size_t limit)
+    : function_(function), limit_(limit) {
+}
+
+SchemaFunction* MemoizedFunction::GetFunction() const {
+    return function_;
+}
+
+void MemoizedFunction::SetFunction(SchemaFunction* function) {
+    function_ = function;
+}
+
+size_t MemoizedFunction::GetLimit() const {
+    return limit_;
+}
+
+namespace {
+
+// The cache is only locked while other threads may be evaluating too
+std::unique_lock<std::mutex> LockIfConcurrent(std::mutex& mutex) {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (concurrent_evaluations.load(std::memory_order_acquire) != 0) {
+        lock.lock();
+    }
+    return lock;
+}
+
+}  // namespace
+
+size_t MemoizedFunction::Count() {
+    auto lock = LockIfConcurrent(mutex_);
+    return entries_.size();
+}
+
+void MemoizedFunction::Clear() {
+    auto lock = LockIfConcurrent(mutex_);
+    index_.clear();
+    entries_.clear();
+}
+
+Object* MemoizedFunction::Invoke(const std::vector<Object*>& args) {
+    std::vector<Object*> values(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        values[i] = Eval(args[i], CurrentScope::Get());
+    }
+    return Apply(values);
+}
+
+Object* MemoizedFunction::Apply(const std::vector<Object*>& values) {
+    {
+        auto lock = LockIfConcurrent(mutex_);
+        auto it = index_.find(&values);
+        if (it != index_.end()) {
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->value;
+        }
+    }
+    // Not locked during the call, which usually calls back into this function
+    Object* value = function_->Apply(values);
+    auto lock = LockIfConcurrent(mutex_);
+    if (index_.count(&values) != 0) {
+        return value;
+    }
+    entries_.push_front({values, value});
+    index_.emplace(&entries_.front().args, entries_.begin());
+    if (limit_ != 0 && entries_.size() > limit_) {
+        index_.erase(&entries_.back().args);
+        entries_.pop_back();
+    }
+    return value;
+}
+
+Object* MemoizeFunction::Invoke(const std::vector<Object*>& args) {
+    RequireAtLeastNArgs(1, args);
+    RequireNotMoreNArgs(2, args);
+    Object* function = Eval(args[0], CurrentScope::Get());
+    RequireIs<SchemaFunction>(function);
+    int64_t limit = 0;
+    if (args.size() == 2) {
+        Object* evaled = Eval(args[1], CurrentScope::Get());
+        RequireIs<Number>(evaled);
+        limit = As<Number>(evaled)->GetValue();
+        if (limit <= 0) {
+            throw RuntimeError{"Memoization limit must be positive"};
+        }
+    }
+    return Heap::Make<MemoizedFunction>(As<SchemaFunction>(function), limit);
+}
+
+Promise::Promise(Object* expr, Scope* scope) : expr_(expr), scope_(scope) {
+}
+
+Promise::Promise(SchemaFunction* function, std::vector<Object*> args)
+    : function_(function), args_(std::move(args)) {
+}
+
+Promise::Promise(Object* value) : value_(value), forced_(true) {
+}
+
+Object* Promise::Force() {
+    Object* expr;
+    Scope* scope;
+    SchemaFunction* function;
+    std::vector<Object*> args;
+    {
+        auto lock = LockIfConcurrent(mutex_);
+        if (forced_) {
+            return value_;
+        }
+        expr = expr_;
+        scope = scope_;
+        function = function_;
+        if (function == nullptr || lock.owns_lock()) {
+            args = args_;
+        } else if (forcing_) {
+            throw RuntimeError{"Stream element depends on itself"};
+        } else if (abandoned_) {
+            throw RuntimeError{"Stream element can't be computed after an earlier error"};
+        } else {
+            // A stream procedure that walks far, such as stream-filter past what it skips,
+            // shouldn't keep the start of the walk alive through this promise
+            args.swap(args_);
+            forcing_ = true;
+        }
+    }
+    // Not locked meanwhile, the computation may force this very promise again
+    Object* value;
+    uint64_t collections = Heap::LoopNursery::Collections();
+    try {
+        value = function != nullptr ? function->Apply(args) : Eval(expr, scope);
+    } catch (...) {
+        auto lock = LockIfConcurrent(mutex_);
+        if (forcing_) {
+            forcing_ = false;
+            // Once a loop collected, what the arguments reference may be gone
+            if (Heap::LoopNursery::Collections() == collections) {
+                args_.swap(args);
+            } else {
+                abandoned_ = true;
+            }
+        }
+        throw;
+    }
+    auto lock = LockIfConcurrent(mutex_);
+    forcing_ = false;
+    if (!forced_) {
+        value_ = value;
+        forced_ = true;
+        expr_ = nullptr;
+        scope_ = nullptr;
+        function_ = nullptr;
+        args_ = std::vector<Object*>();
+    }
+    return value_;
+}
+
+bool Promise::IsForced() {
+    auto lock = LockIfConcurrent(mutex_);
+    return forced_;
+}
+
+Object* Promise::GetValue() {
+    auto lock = LockIfConcurrent(mutex_);
+    return value_;
+}
+
+Object* Promise::GetExpr() {
+    auto lock = LockIfConcurrent(mutex_);
+    return expr_;
+}
+
+Scope* Promise::GetScope() {
+    auto lock = LockIfConcurrent(mutex_);
+    return scope_;
+}
+
+SchemaFunction* Promise::GetFunction() {
+    auto lock = LockIfConcurrent(mutex_);
+    return function_;
+}
+
+std::vector<Object*> Promise::GetArgs() {
+    auto lock = LockIfConcurrent(mutex_);
+    return args_;
+}
+
+void Promise::Restore(bool forced, Object* value, Object* expr, Scope* scope,
+                      SchemaFunction* function, std::vector<Object*> args) {
+    auto lock = LockIfConcurrent(mutex_);
+    forced_ = forced;
+    value_ = value;
+    expr_ = expr;
+    scope_ = scope;
+    function_ = function;
+    args_ = std::move(args);
+}
+
+Object* DelayFunction::Invoke(const std::vector<Object*>& args) {
+    RequireNArgs<SyntaxError>(1, args);
+    return Heap::Make<Promise>(args[0], CurrentScope::Get());
+}
+
+Object* ConsStreamFunction::Invoke(const std::vector<Object*>& args) {
+    RequireNArgs<SyntaxError>(2, args);
+    Object* head = Eval(args[0], CurrentScope::Get());
+    return Cons(head, Heap::Make<Promise>(args[1], CurrentScope::Get()));
+}
+
+Object* ForceStream(Object* stream) {
+    while (Is<Promise>(stream)) {
+        stream = As<Promise>(stream)->Force();
+    }
+    if (stream != nullptr && !Is<Cell>(stream)) {
+        throw RuntimeError{"Expected a stream"};
+    }
+    return stream;
+}
+
+namespace {
+
+std::vector<Object*> EvalArgs(const std::vector<Object*>& args) {
+    std::vector<Object*> values(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        values[i] = Eval(args[i], CurrentScope::Get());
+    }
+    return values;
+}
+
+}  // namespace
+
+Object* StreamMapFunction::Invoke(const std::vector<Object*>& args) {
+    return Apply(EvalArgs(args));
+}
+
+Object* StreamMapFunction::Apply(const std::vector<Object*>& values) {
+    RequireNArgs(2, values);
+    RequireIs<SchemaFunction>(values[0]);
+    Object* stream = ForceStream(values[1]);
+    if (stream == nullptr) {
+        return nullptr;
+    }
+    Cell* cell = As<Cell>(stream);
+    Object* head = As<SchemaFunction>(values[0])->Apply({cell->GetFirst()});
+    std::vector<Object*> rest{values[0], cell->GetSecond()};
+    return Cons(head, Heap::Make<Promise>(this, std::move(rest)));
+}
+
+Object* StreamFilterFunction::Invoke(const std::vector<Object*>& args) {
+    return Apply(EvalArgs(args));
+}
+
+Object* StreamFilterFunction::Apply(const std::vector<Object*>& values) {
+    RequireNArgs(2, values);
+    RequireIs<SchemaFunction>(values[0]);
+    SchemaFunction* predicate = As<SchemaFunction>(values[0]);
+    // Skipped elements are walked past in a loop, a long run of them takes no stack, and
+    // neither memory once nothing else references them
+    Heap::LoopNursery nursery;
+    for (Object* stream = ForceStream(values[1]); stream != nullptr;
+         stream = ForceStream(As<Cell>(stream)->GetSecond())) {
+        Cell* cell = As<Cell>(stream);
+        if (IsTrue(predicate->Apply({cell->GetFirst()}))) {
+            std::vector<Object*> rest{predicate, cell->GetSecond()};
+            return Cons(cell->GetFirst(), Heap::Make<Promise>(this, std::move(rest)));
+        }
+        nursery.Collect({predicate, cell});
+    }
+    return nullptr;
+}
+
+Object* StreamTakeFunction::Invoke(const std::vector<Object*>& args) {
+    return Apply(EvalArgs(args));
+}
+
+Object* StreamTakeFunction::Apply(const std::vector<Object*>& values) {
+    RequireNArgs(2, values);
+    RequireIs<Number>(values[1]);
+    int64_t count = As<Number>(values[1])->GetValue();
+    if (count <= 0) {
+        return nullptr;
+    }
+    Object* stream = ForceStream(values[0]);
+    if (stream == nullptr) {
+        return nullptr;
+    }
+    Cell* cell = As<Cell>(stream);
+    std::vector<Object*> rest{cell->GetSecond(), Heap::Make<Number>(count - 1)};
+    return Cons(cell->GetFirst(), Heap::Make<Promise>(this, std::move(rest)));
+}
+
+Object* LineStreamFunction::Invoke(const std::vector<Object*>& args) {
+    return Apply(EvalArgs(args));
+}
+
+Object* LineStreamFunction::Apply(const std::vector<Object*>& values) {
+    RequireNArgs(1, values);
+    RequireIs<InputPort>(values[0]);
+    auto line = As<InputPort>(values[0])->ReadLine();
+    if (!line) {
+        return nullptr;
+    }
+    Object* head = Heap::Make<String>(std::string(*line));
+    return Cons(head, Heap::Make<Promise>(this, std::vector<Object*>{values[0]}));
+}
+
+namespace {
+
+// Calls body(begin, end) on the thread pool for consecutive chunks of count items. Every
+// task allocates into a nursery heap of its own, which is merged into the caller's heap
+// once all of them are done.
+void ParallelChunks(size_t count, size_t chunk_size,
+                    const std::function<void(size_t, size_t)>& body) {
+    ThreadPool& pool = ThreadPool::Instance();
+    if (chunk_size == 0) {
+        chunk_size = std::max<size_t>(1, count / (4 * pool.Size()));
+    }
+    std::vector<std::unique_ptr<Heap>> nurseries;
+    Scope* scope = CurrentScope::Get();
+    std::shared_ptr<TaskLimits> limits = CurrentTaskLimits();
+    std::exception_ptr error;
+    BeginConcurrentEvaluation();
+    {
+        TaskGroup group(pool);
+        for (size_t begin = 0; begin < count; begin += chunk_size) {
+            size_t end = std::min(count, begin + chunk_size);
+            nurseries.push_back(std::make_unique<Heap>());
+            Heap* nursery = nurseries.back().get();
+            group.Run([=, &body] {
+                Heap::Activation activation(nursery);
+                Scope* saved_scope = CurrentScope::Get();
+                CurrentScope::Set(scope);
+                RunWithLimits(limits, [&] { body(begin, end); });
+                CurrentScope::Set(saved_scope);
+            });
+        }
+        try {
+            group.Wait();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    concurrent_evaluations--;
+    for (auto& x : nurseries) {
+        Heap::Instance().Merge(x.get());
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// The function, items and chunk size of (parallel-map function list [chunk-size]) and
+// parallel-for-each, evaluated. A chunk size of zero picks one by the size of the pool.
+struct ParallelArgs {
+    SchemaFunction* function;
+    std::vector<Object*> items;
+    size_t chunk_size = 0;
+
+    explicit ParallelArgs(const std::vector<Object*>& args) {
+        RequireAtLeastNArgs(2, args);
+        RequireNotMoreNArgs(3, args);
+        std::vector<Object*> evals(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
+            evals[i] = Eval(args[i], CurrentScope::Get());
+        }
+        RequireIs<SchemaFunction>(evals[0]);
+        function = As<SchemaFunction>(evals[0]);
+        items = ListToVector(evals[1]);
+        if (evals.size() == 3) {
+            RequireIs<Number>(evals[2]);
+            if (As<Number>(evals[2])->GetValue() <= 0) {
+                throw RuntimeError{"Chunk size must be positive"};
+            }
+            chunk_size = As<Number>(evals[2])->GetValue();
+        }
+    }
+};
+
+}  // namespace
+
+// Calls the function on every item on the thread pool, a chunk of items per task
+std::vector<Object*> ParallelApply(SchemaFunction* function, const std::vector<Object*>& items,
+                                   size_t chunk_size) {
+    std::vector<Object*> results(items.size());
+    ParallelChunks(items.size(), chunk_size, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            results[i] = function->Apply({items[i]});
+        }
+    });
+    return results;
+}
+
+Object* ParallelMapFunction::Invoke(const std::vector<Object*>& args) {
+    ParallelArgs parallel(args);
+    return VectorToList(ParallelApply(parallel.function, parallel.items, parallel.chunk_size));
+}
+
+Object* ParallelForEachFunction::Invoke(const std::vector<Object*>& args) {
+    ParallelArgs parallel(args);
+    // Results are dropped as they come, nothing is kept for them
+    ParallelChunks(parallel.items.size(), parallel.chunk_size, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            parallel.function->Apply({parallel.items[i]});
+        }
+    });
+    return nullptr;
+}
+
+namespace {
+
+// The value of a call made through InvokeTail, for callers that can't continue in place
+Object* FinishTail(Object* result, const TailCall& tail) {
+    if (tail.scope == nullptr) {
+        return result;
+    }
+    return Eval(tail.expr, tail.scope);
+}
+
+// Evaluates the body from begin in scope, except for its last expression, which is left
+// in tail. An empty body has no value.
+Object* EvalBody(const std::vector<Object*>& body, size_t begin, Scope* scope, TailCall* tail) {
+    if (begin >= body.size()) {
+        return nullptr;
+    }
+    for (size_t i = begin; i + 1 < body.size(); ++i) {
+        Eval(body[i], scope);
+    }
+    tail->expr = body.back();
+    tail->scope = scope;
+    return nullptr;
+}
+
+struct Binding {
+    std::string name;
+    Object* init = nullptr;
+    Object* step = nullptr;
+};
+
+// Parses ((name init) ...), where do also allows ((name init step) ...)
+std::vector<Binding> ParseBindings(Object* list, bool allow_steps) {
+    std::vector<Binding> bindings;
+    for (; list != nullptr; list = As<Cell>(list)->GetSecond()) {
+        if (!Is<Cell>(list)) {
+            throw SyntaxError{"Invalid binding list"};
+        }
+        Object* spec = As<Cell>(list)->GetFirst();
+        std::vector<Object*> parts;
+        for (; Is<Cell>(spec); spec = As<Cell>(spec)->GetSecond()) {
+            parts.push_back(As<Cell>(spec)->GetFirst());
+        }
+        if (spec != nullptr || parts.size() < 2 || parts.size() > (allow_steps ? 3 : 2) ||
+            !Is<Symbol>(parts[0])) {
+            throw SyntaxError{"Invalid binding"};
+        }
+        Binding binding;
+        binding.name = As<Symbol>(parts[0])->GetName();
+        binding.init = parts[1];
+        binding.step = parts.size() == 3 ? parts[2] : nullptr;
+        bindings.push_back(std::move(binding));
+    }
+    return bindings;
+}
+
+}  // namespace
+
+Object* LambdaFunction::Invoke(const std::vector<Object*>& args) {
+    RequireAtLeastNArgs<SyntaxError>(2, args);
+
+    std::vector<Object*> fmt_ptrs;
+    if (args[0] != nullptr) {
+        RequireIs<Cell>(args[0]);
+        Cell::BoarIterator it(As<Cell>(args[0]));
+
+        fmt_ptrs.push_back(it.Get());
+        while (it.Advance()) {
+            fmt_ptrs.push_back(it.Get());
+        }
+        if (fmt_ptrs.back() == nullptr) {
+            fmt_ptrs.pop_back();
+        }
+
+        RequireArgsAre<Symbol>(fmt_ptrs);
+    }
+    std::vector<Object*> body = args;
+    body.erase(body.begin());
+
+    std::vector<std::string> fmt;
+    fmt.reserve(fmt_ptrs.size());
+    for (auto& x : fmt_ptrs) {
+        fmt.push_back(As<Symbol>(x)->GetName());
+    }
+
+    return Heap::Make<LambdaImplFunction>(fmt, body);
+}
+
+Object* LambdaFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    // Folding may replace whole expressions of the body, which args still holds
+    if (tail->call != nullptr && FoldConstants(tail->call)) {
+        return Invoke(ListToVector(tail->call->GetSecond()));
+    }
+    return Invoke(args);
+}
+
+LambdaImplFunction::LambdaImplFunction(const std::vector<std::string>& fmt,
+                                       const std::vector<Object*>& cmds) {
+    args_fmt_ = fmt;
+    cmds_ = cmds;
+    lsc_ = Heap::Make<Scope>(CurrentScope::Get());
+}
+
+LambdaImplFunction::LambdaImplFunction(const std::vector<std::string>& fmt,
+                                       const std::vector<Object*>& cmds, Scope* scope)
+    : args_fmt_(fmt), cmds_(cmds), lsc_(scope) {
+}
+
+Scope* LambdaImplFunction::GetScope() {
+    return lsc_;
+}
+
+void LambdaImplFunction::SetScope(Scope* scope) {
+    lsc_ = scope;
+}
+
+const std::vector<std::string>& LambdaImplFunction::GetArgs() const {
+    return args_fmt_;
+}
+
+const std::vector<Object*>& LambdaImplFunction::GetBody() const {
+    return cmds_;
+}
+
+void LambdaImplFunction::SetBody(const std::vector<Object*>& cmds) {
+    cmds_ = cmds;
+}
+
+Object* LambdaImplFunction::Invoke(const std::vector<Object*>& args) {
+    TailCall tail;
+    return FinishTail(InvokeTail(args, &tail), tail);
+}
+
+Object* LambdaImplFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    RequireNArgs<RuntimeError>(args_fmt_.size(), args);
+    std::vector<Object*> values(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        values[i] = Eval(args[i], CurrentScope::Get());
+    }
+    return ApplyTail(values, tail);
+}
+
+Object* LambdaImplFunction::Apply(const std::vector<Object*>& values) {
+    TailCall tail;
+    return FinishTail(ApplyTail(values, &tail), tail);
+}
+
+Object* LambdaImplFunction::ApplyTail(const std::vector<Object*>& values, TailCall* tail) {
+    RequireNArgs<RuntimeError>(args_fmt_.size(), values);
+    Scope* safe_scope = Heap::Make<Scope>(lsc_);
+    for (size_t i = 0; i < values.size(); ++i) {
+        safe_scope->DefineSymbol(args_fmt_[i], values[i]);
+    }
+    return EvalBody(cmds_, 0, safe_scope, tail);
+}
+
+Object* TailForm::Invoke(const std::vector<Object*>& args) {
+    TailCall tail;
+    return FinishTail(InvokeTail(args, &tail), tail);
+}
+
+Object* IfFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    RequireAtLeastNArgs<SyntaxError>(2, args);
+    RequireNotMoreNArgs<SyntaxError>(3, args);
+
+    Object* eval1 = Eval(args[0], CurrentScope::Get());
+
+    if (IsTrue(eval1)) {
+        tail->expr = args[1];
+    } else if (args.size() == 3) {
+        tail->expr = args[2];
+    } else {
+        return nullptr;
+    }
+    tail->scope = CurrentScope::Get();
+    return nullptr;
+}
+
+Object* BeginFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    return EvalBody(args, 0, CurrentScope::Get(), tail);
+}
+
+Object* LetFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    RequireAtLeastNArgs<SyntaxError>(2, args);
+    Scope* outer = CurrentScope::Get();
+    if (Is<Symbol>(args[0])) {
+        // Named let: the loop procedure is bound in a frame of its own, seen by its body only
+        RequireAtLeastNArgs<SyntaxError>(3, args);
+        std::vector<std::string> names;
+        std::vector<Object*> values;
+        for (auto& x : ParseBindings(args[1], false)) {
+            names.push_back(x.name);
+            values.push_back(Eval(x.init, outer));
+        }
+        Scope* frame = Heap::Make<Scope>(outer);
+        LambdaImplFunction* loop = Heap::Make<LambdaImplFunction>(
+            names, std::vector<Object*>(args.begin() + 2, args.end()), frame);
+        frame->DefineSymbol(As<Symbol>(args[0])->GetName(), loop);
+        return loop->ApplyTail(values, tail);
+    }
+    std::vector<Binding> bindings = ParseBindings(args[0], false);
+    std::vector<Object*> values(bindings.size());
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        values[i] = Eval(bindings[i].init, outer);
+    }
+    Scope* frame = Heap::Make<Scope>(outer);
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        frame->DefineSymbol(bindings[i].name, values[i]);
+    }
+    return EvalBody(args, 1, frame, tail);
+}
+
+// Each binding is made in a frame of its own, in which the following inits are evaluated.
+// Closures made by an init see the bindings before it only, even when a name is rebound.
+Object* LetStarFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    RequireAtLeastNArgs<SyntaxError>(2, args);
+    Scope* frame = CurrentScope::Get();
+    for (auto& x : ParseBindings(args[0], false)) {
+        Object* value = Eval(x.init, frame);
+        frame = Heap::Make<Scope>(frame);
+        frame->DefineSymbol(x.name, value);
+    }
+    // The body gets a frame for its internal definitions even without bindings
+    if (frame == CurrentScope::Get()) {
+        frame = Heap::Make<Scope>(frame);
+    }
+    return EvalBody(args, 1, frame, tail);
+}
+
+// The inits are evaluated left to right, with every name bound to the empty list until
+// its own init is done
+Object* LetrecFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    RequireAtLeastNArgs<SyntaxError>(2, args);
+    std::vector<Binding> bindings = ParseBindings(args[0], false);
+    Scope* frame = Heap::Make<Scope>(CurrentScope::Get());
+    for (auto& x : bindings) {
+        frame->DefineSymbol(x.name, nullptr);
+    }
+    for (auto& x : bindings) {
+        frame->DefineSymbol(x.name, Eval(x.init, frame));
+    }
+    return EvalBody(args, 1, frame, tail);
+}
+
+Object* DoFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    RequireAtLeastNArgs<SyntaxError>(2, args);
+    std::vector<Binding> bindings = ParseBindings(args[0], true);
+    if (!Is<Cell>(args[1])) {
+        throw SyntaxError{"Invalid use of 'do'"};
+    }
+    std::vector<Object*> exit = ListToVector(args[1]);
+
+    Scope* outer = CurrentScope::Get();
+    Scope* frame = Heap::Make<Scope>(outer);
+    for (auto& x : bindings) {
+        frame->DefineSymbol(x.name, Eval(x.init, outer));
+    }
+    std::vector<Object*> steps(bindings.size());
+    while (!IsTrue(Eval(exit[0], frame))) {
+        CountStep();
+        for (size_t i = 2; i < args.size(); ++i) {
+            Eval(args[i], frame);
+        }
+        for (size_t i = 0; i < bindings.size(); ++i) {
+            steps[i] = bindings[i].step ? Eval(bindings[i].step, frame)
+                                        : frame->LookUpSymbol(bindings[i].name);
+        }
+        // A fresh frame per iteration, closures made by the body keep the bindings they saw
+        frame = Heap::Make<Scope>(outer);
+        for (size_t i = 0; i < bindings.size(); ++i) {
+            frame->DefineSymbol(bindings[i].name, steps[i]);
+        }
+    }
+    return EvalBody(exit, 1, frame, tail);
+}
+
+namespace {
+
+bool IsElse(Object* obj) {
+    return Is<Symbol>(obj) && As<Symbol>(obj)->GetName() == "else";
+}
+
+// Evaluates the expressions of a cond or case clause, leaving the last one in tail, or
+// passes the value to the receiver of a (=> receiver) clause
+Object* EvalClause(Object* body, Object* value, Scope* scope, TailCall* tail) {
+    if (body == nullptr) {
+        return value;
+    } else if (!Is<Cell>(body)) {
+        throw SyntaxError{"Invalid clause"};
+    }
+    Object* head = As<Cell>(body)->GetFirst();
+    if (Is<Symbol>(head) && As<Symbol>(head)->GetName() == "=>") {
+        Object* rest = As<Cell>(body)->GetSecond();
+        if (!Is<Cell>(rest) || As<Cell>(rest)->GetSecond() != nullptr) {
+            throw SyntaxError{"Invalid use of '=>'"};
+        }
+        Object* receiver = Eval(As<Cell>(rest)->GetFirst(), scope);
+        if (Is<LambdaImplFunction>(receiver)) {
+            return As<LambdaImplFunction>(receiver)->ApplyTail({value}, tail);
+        }
+        RequireIs<SchemaFunction>(receiver);
+        return As<SchemaFunction>(receiver)->Apply({value});
+    }
+    for (; Is<Cell>(As<Cell>(body)->GetSecond()); body = As<Cell>(body)->GetSecond()) {
+        Eval(As<Cell>(body)->GetFirst(), scope);
+    }
+    if (As<Cell>(body)->GetSecond() != nullptr) {
+        throw SyntaxError{"Invalid clause"};
+    }
+    tail->expr = As<Cell>(body)->GetFirst();
+    tail->scope = scope;
+    return nullptr;
+}
+
+}  // namespace
+
+Object* CondFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    Scope* scope = CurrentScope::Get();
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (!Is<Cell>(args[i])) {
+            throw SyntaxError{"Invalid cond clause"};
+        }
+        Cell* clause = As<Cell>(args[i]);
+        if (IsElse(clause->GetFirst())) {
+            if (i + 1 != args.size()) {
+                throw SyntaxError{"The else clause must come last"};
+            }
+            return EvalClause(clause->GetSecond(), nullptr, scope, tail);
+        }
+        Object* value = Eval(clause->GetFirst(), scope);
+        if (IsTrue(value)) {
+            return EvalClause(clause->GetSecond(), value, scope, tail);
+        }
+    }
+    return nullptr;
+}
+
+CaseTable::CaseTable(const std::vector<Object*>& clauses) : clauses_(clauses) {
+    std::vector<std::pair<int64_t, size_t>> fixnums;
+    for (size_t i = 0; i < clauses_.size(); ++i) {
+        if (!Is<Cell>(clauses_[i])) {
+            throw SyntaxError{"Invalid case clause"};
+        }
+        Object* datums = As<Cell>(clauses_[i])->GetFirst();
+        if (IsElse(datums)) {
+            if (i + 1 != clauses_.size()) {
+                throw SyntaxError{"The else clause must come last"};
+            }
+            else_clause_ = clauses_[i];
+            break;
+        }
+        // A datum listed again in a later clause keeps selecting the first one
+        for (; Is<Cell>(datums); datums = As<Cell>(datums)->GetSecond()) {
+            Object* datum = As<Cell>(datums)->GetFirst();
+            if (Is<Number>(datum)) {
+                fixnums.emplace_back(As<Number>(datum)->GetValue(), i);
+            } else if (Is<Symbol>(datum)) {
+                symbols_.emplace(As<Symbol>(datum)->GetName(), i);
+            } else {
+                others_.emplace_back(datum, i);
+            }
+        }
+        if (datums != nullptr) {
+            throw SyntaxError{"Invalid case clause"};
+        }
+    }
+    if (fixnums.empty()) {
+        return;
+    }
+    auto [min, max] = std::minmax_element(
+        fixnums.begin(), fixnums.end(), [](auto& a, auto& b) { return a.first < b.first; });
+    uint64_t span = uint64_t(max->first) - uint64_t(min->first);
+    if (span <= 2 * fixnums.size() + 16) {
+        dense_base_ = min->first;
+        dense_.assign(span + 1, -1);
+        for (auto& x : fixnums) {
+            int32_t& slot = dense_[uint64_t(x.first) - uint64_t(dense_base_)];
+            if (slot < 0) {
+                slot = x.second;
+            }
+        }
+    } else {
+        fixnums_.insert(fixnums.begin(), fixnums.end());
+    }
+}
+
+Object* CaseTable::Find(Object* key) const {
+    if (Is<Number>(key)) {
+        int64_t value = As<Number>(key)->GetValue();
+        if (!dense_.empty()) {
+            uint64_t offset = uint64_t(value) - uint64_t(dense_base_);
+            if (offset < dense_.size() && dense_[offset] >= 0) {
+                return clauses_[dense_[offset]];
+            }
+        } else if (auto it = fixnums_.find(value); it != fixnums_.end()) {
+            return clauses_[it->second];
+        }
+    } else if (Is<Symbol>(key)) {
+        if (auto it = symbols_.find(As<Symbol>(key)->GetName()); it != symbols_.end()) {
+            return clauses_[it->second];
+        }
+    } else {
+        for (auto& x : others_) {
+            if (IsEqual(x.first, key)) {
+                return clauses_[x.second];
+            }
+        }
+    }
+    return else_clause_;
+}
+
+Object* CaseTable::GetSource() const {
+    return clauses_[0];
+}
+
+Object* CaseFunction::InvokeTail(const std::vector<Object*>& args, TailCall* tail) {
+    RequireAtLeastNArgs<SyntaxError>(1, args);
+    Scope* scope = CurrentScope::Get();
+    Object* key = Eval(args[0], scope);
+    if (args.size() == 1) {
+        return nullptr;
+    }
+    CaseTable* table = nullptr;
+    if (Is<CaseTable>(args[1])) {
+        table = As<CaseTable>(args[1]);
+    } else {
+        table = Heap::Make<CaseTable>(std::vector<Object*>(args.begin() + 1, args.end()));
+        // The table replaces the first clause in the form, unless another thread could be
+        // evaluating the same form right now
+        if (tail->call != nullptr && concurrent_evaluations.load(std::memory_order_acquire) == 0) {
+            As<Cell>(As<Cell>(tail->call->GetSecond())->GetSecond())->SetFirst(table);
+        }
+    }
+    Object* clause = table->Find(key);
+    if (clause == nullptr) {
+        return nullptr;
+    }
+    return EvalClause(As<Cell>(clause)->GetSecond(), key, scope, tail);
+}
+
+FoldedForm::FoldedForm(Object* original, Object* folded, Scope* global)
+    : original_(original), folded_(folded), global_(global),
+      epoch_(global->GetFoldingEpoch()) {
+}
+
+Object* FoldedForm::Select() const {
+    return epoch_ == global_->GetFoldingEpoch() ? folded_ : original_;
+}
+
+Object* FoldedForm::GetOriginal() const {
+    return original_;
+}
+
+Object* FoldedForm::GetFolded() const {
+    return folded_;
+}
+
+pid_t ForkProcess() {
+    std::lock_guard<std::mutex> lock(fork_mutex);
+    if (concurrent_evaluations.load(std::memory_order_acquire) != 0) {
+        throw RuntimeError{"Can not fork while futures or parallel-map calls are running"};
+    }
+    return fork();
+}
+
+namespace {
+
+// Walks code from the inside out, replacing whatever it folds in the cell that holds it
+class ConstantFolder {
+private:
+    Scope* scope_;
+    Scope* global_;
+    // Names bound by the enclosing forms, which shadow the scope
+    std::vector<std::string> locals_;
+    bool changed_ = false;
+
+    // The foldable function that head names in the global scope, null for anything else
+    SchemaFunction* Resolve(Object* head) const {
+        if (!Is<Symbol>(head)) {
+            return nullptr;
+        }
+        const std::string& name = As<Symbol>(head)->GetName();
+        if (std::find(locals_.begin(), locals_.end(), name) != locals_.end()) {
+            return nullptr;
+        }
+        Scope* owner = scope_->IsDefined(name);
+        if (owner == nullptr || owner->GetParent() != nullptr) {
+            return nullptr;
+        }
+        Object* value = owner->LookUpSymbol(name);
+        return IsFoldable(value) ? As<SchemaFunction>(value) : nullptr;
+    }
+
+    // Whether expr always evaluates to the same value, which is stored in value
+    bool IsConstant(Object* expr, Object** value) const {
+        if (Is<FoldedForm>(expr)) {
+            return IsConstant(As<FoldedForm>(expr)->Select(), value);
+        } else if (Is<Number>(expr) || Is<Real>(expr) || Is<Boolean>(expr) ||
+                   Is<String>(expr)) {
+            *value = expr;
+            return true;
+        } else if (Is<Cell>(expr) && Is<QuoteFunction>(Resolve(As<Cell>(expr)->GetFirst()))) {
+            Object* rest = As<Cell>(expr)->GetSecond();
+            if (Is<Cell>(rest) && As<Cell>(rest)->GetSecond() == nullptr) {
+                *value = As<Cell>(rest)->GetFirst();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static Object* First(Object* list) {
+        return As<Cell>(list)->GetFirst();
+    }
+
+    static Object* Rest(Object* list) {
+        return As<Cell>(list)->GetSecond();
+    }
+
+    // The elements of a proper list, false for anything else
+    static bool Elements(Object* list, std::vector<Object*>* items) {
+        for (; Is<Cell>(list); list = Rest(list)) {
+            items->push_back(First(list));
+        }
+        return list == nullptr;
+    }
+
+    void BindSymbols(Object* list) {
+        for (; Is<Cell>(list); list = Rest(list)) {
+            if (Is<Symbol>(First(list))) {
+                locals_.push_back(As<Symbol>(First(list))->GetName());
+            }
+        }
+        if (Is<Symbol>(list)) {
+            locals_.push_back(As<Symbol>(list)->GetName());
+        }
+    }
+
+    // The names of ((name init) ...), and of what the body defines internally
+    void BindBindings(Object* bindings) {
+        for (; Is<Cell>(bindings); bindings = Rest(bindings)) {
+            if (Is<Cell>(First(bindings)) && Is<Symbol>(First(First(bindings)))) {
+                locals_.push_back(As<Symbol>(First(First(bindings)))->GetName());
+            }
+        }
+    }
+
+    void BindDefinitions(Object* body) {
+        for (; Is<Cell>(body); body = Rest(body)) {
+            Object* form = First(body);
+            if (!Is<Cell>(form) || !Is<Symbol>(First(form)) || !Is<Cell>(Rest(form))) {
+                continue;
+            }
+            const std::string& head = As<Symbol>(First(form))->GetName();
+            Object* target = First(Rest(form));
+            if (head == "begin") {
+                BindDefinitions(Rest(form));
+            } else if (head != "define" && head != "define-memoized") {
+                continue;
+            } else if (Is<Symbol>(target)) {
+                locals_.push_back(As<Symbol>(target)->GetName());
+            } else if (Is<Cell>(target) && Is<Symbol>(First(target))) {
+                locals_.push_back(As<Symbol>(First(target))->GetName());
+            }
+        }
+    }
+
+    void FoldSlot(Cell* cell) {
+        Object* folded = Fold(cell->GetFirst());
+        if (folded != cell->GetFirst()) {
+            cell->SetFirst(folded);
+            changed_ = true;
+        }
+    }
+
+    void FoldSlots(Object* list) {
+        for (; Is<Cell>(list); list = Rest(list)) {
+            FoldSlot(As<Cell>(list));
+        }
+    }
+
+    void FoldBody(Object* body) {
+        size_t bound = locals_.size();
+        BindDefinitions(body);
+        FoldSlots(body);
+        locals_.resize(bound);
+    }
+
+    // The inits, and for do the steps, of ((name init [step]) ...)
+    void FoldBindings(Object* bindings) {
+        for (; Is<Cell>(bindings); bindings = Rest(bindings)) {
+            if (Is<Cell>(First(bindings))) {
+                FoldSlots(Rest(First(bindings)));
+            }
+        }
+    }
+
+    // (let [name] bindings body ...), the names are taken as bound in the inits as well
+    void FoldLet(Object* args, bool is_do) {
+        size_t bound = locals_.size();
+        if (!is_do && Is<Cell>(args) && Is<Symbol>(First(args))) {
+            locals_.push_back(As<Symbol>(First(args))->GetName());
+            args = Rest(args);
+        }
+        if (Is<Cell>(args)) {
+            BindBindings(First(args));
+            FoldBindings(First(args));
+            if (!is_do) {
+                FoldBody(Rest(args));
+            } else if (Is<Cell>(Rest(args))) {
+                FoldSlots(First(Rest(args)));
+                FoldBody(Rest(Rest(args)));
+            }
+        }
+        locals_.resize(bound);
+    }
+
+    Object* FoldIf(Cell* form) {
+        std::vector<Object*> items;
+        Object* condition = nullptr;
+        if (!Elements(form->GetSecond(), &items) || items.size() < 2 || items.size() > 3 ||
+            !IsConstant(items[0], &condition)) {
+            return form;
+        }
+        if (IsTrue(condition)) {
+            return Heap::Make<FoldedForm>(form, items[1], global_);
+        } else if (items.size() == 3) {
+            return Heap::Make<FoldedForm>(form, items[2], global_);
+        }
+        return form;
+    }
+
+    // Drops the operands that can't decide the value, and whatever follows one that does
+    Object* FoldAndOr(Cell* form, bool is_and) {
+        std::vector<Object*> items;
+        if (!Elements(form->GetSecond(), &items)) {
+            return form;
+        }
+        std::vector<Object*> kept;
+        for (size_t i = 0; i < items.size(); ++i) {
+            Object* value = nullptr;
+            if (!IsConstant(items[i], &value)) {
+                kept.push_back(items[i]);
+            } else if (IsTrue(value) != is_and) {
+                kept.push_back(items[i]);
+                break;
+            } else if (i + 1 == items.size()) {
+                kept.push_back(items[i]);
+            }
+        }
+        if (kept.size() == items.size()) {
+            return form;
+        } else if (kept.size() == 1) {
+            return Heap::Make<FoldedForm>(form, kept[0], global_);
+        }
+        Object* rest = nullptr;
+        for (size_t i = kept.size(); i > 0; --i) {
+            rest = Cons(kept[i - 1], rest);
+        }
+        return Heap::Make<FoldedForm>(form, Cons(form->GetFirst(), rest), global_);
+    }
+
+    // Calls a foldable builtin whose arguments are all constant, unless it fails or its
+    // value is not a constant either
+    Object* FoldCall(Cell* form, SchemaFunction* function) {
+        std::vector<Object*> items;
+        if (!Elements(form->GetSecond(), &items)) {
+            return form;
+        }
+        std::vector<Object*> values(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (!IsConstant(items[i], &values[i])) {
+                return form;
+            }
+        }
+        Object* result = nullptr;
+        try {
+            result = function->Apply(values);
+        } catch (const RuntimeError&) {
+            return form;
+        } catch (const SyntaxError&) {
+            return form;
+        } catch (const NameError&) {
+            return form;
+        }
+        if (!Is<Number>(result) && !Is<Real>(result) && !Is<Boolean>(result) &&
+            !Is<String>(result)) {
+            return form;
+        }
+        return Heap::Make<FoldedForm>(form, result, global_);
+    }
+
+public:
+    explicit ConstantFolder(Scope* scope) : scope_(scope), global_(scope->GetGlobal()) {
+    }
+
+    bool Changed() const {
+        return changed_;
+    }
+
+    // (lambda formals body ...) or (define (name formals) body ...)
+    void FoldDefinition(Cell* form) {
+        form->SetFolded();
+        Object* args = form->GetSecond();
+        if (Is<Cell>(args)) {
+            size_t bound = locals_.size();
+            BindSymbols(First(args));
+            FoldBody(Rest(args));
+            locals_.resize(bound);
+        }
+    }
+
+    // What takes the place of expr
+    Object* Fold(Object* expr) {
+        if (!Is<Cell>(expr)) {
+            return expr;
+        }
+        Cell* form = As<Cell>(expr);
+        Object* args = form->GetSecond();
+        SchemaFunction* function = Resolve(form->GetFirst());
+        if (Is<QuoteFunction>(function)) {
+            return form;
+        } else if (Is<LambdaFunction>(function)) {
+            FoldDefinition(form);
+            return form;
+        } else if (Is<DefineFunction>(function) || Is<DefineMemoizedFunction>(function)) {
+            if (Is<Cell>(args) && Is<Cell>(First(args))) {
+                FoldDefinition(form);
+            } else if (Is<Cell>(args)) {
+                FoldSlots(Rest(args));
+            }
+            return form;
+        } else if (Is<SetFunction>(function)) {
+            if (Is<Cell>(args)) {
+                FoldSlots(Rest(args));
+            }
+            return form;
+        } else if (Is<LetFunction>(function) || Is<LetStarFunction>(function) ||
+                   Is<LetrecFunction>(function) || Is<DoFunction>(function)) {
+            FoldLet(args, Is<DoFunction>(function));
+            return form;
+        } else if (Is<CondFunction>(function)) {
+            for (; Is<Cell>(args); args = Rest(args)) {
+                FoldSlots(First(args));
+            }
+            return form;
+        } else if (Is<CaseFunction>(function)) {
+            // The datums are not expressions, and the first clause may be a CaseTable
+            if (Is<Cell>(args)) {
+                FoldSlot(As<Cell>(args));
+                for (args = Rest(args); Is<Cell>(args); args = Rest(args)) {
+                    if (Is<Cell>(First(args))) {
+                        FoldSlots(Rest(First(args)));
+                    }
+                }
+            }
+            return form;
+        }
+        FoldSlot(form);
+        FoldSlots(args);
+        if (function == nullptr || Is<BeginFunction>(function)) {
+            return form;
+        } else if (Is<IfFunction>(function)) {
+            return FoldIf(form);
+        } else if (Is<AndFunction>(function) || Is<OrFunction>(function)) {
+            return FoldAndOr(form, Is<AndFunction>(function));
+        }
+        return FoldCall(form, function);
+    }
+};
+
+}  // namespace
+
+bool FoldConstants(Cell* form) {
+    if (form->IsFolded() || concurrent_evaluations.load(std::memory_order_acquire) != 0) {
+        return false;
+    }
+    ConstantFolder folder(CurrentScope::Get());
+    folder.FoldDefinition(form);
+    return folder.Changed();
+}
+
+Future::Future(Object* expr, Scope* scope)
+    : expr_(expr), scope_(scope), nursery_(std::make_unique<Heap>()),
+      task_(std::make_unique<TaskGroup>()) {
+    BeginConcurrentEvaluation();
+    task_->Run([this, limits = CurrentTaskLimits()] {
+        Heap::Activation activation(nursery_.get());
+        Scope* saved_scope = CurrentScope::Get();
+        try {
+            RunWithLimits(limits, [this] { value_ = Eval(expr_, scope_); });
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+        CurrentScope::Set(saved_scope);
+        // Whoever sees the future finished sees the evaluation over too
+        concurrent_evaluations--;
+        finished_ = true;
+    });
+}
+
+Future::~Future() {
+    Wait();
+}
+
+bool Future::IsPending() const {
+    return !finished_;
+}
+
+void Future::Wait() {
+    task_->Wait();
+}
+
+void Future::MergeNursery() {
+    Wait();
+    if (!merged_) {
+        Heap::Instance().Merge(nursery_.get());
+        merged_ = true;
+    }
+}
+
+Object* Future::Touch() {
+    MergeNursery();
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    return value_;
+}
+
+Object* FutureFunction::Invoke(const std::vector<Object*>& args) {
+    RequireNArgs<SyntaxError>(1, args);
+    Future* future = Heap::Make<Future>(args[0], CurrentScope::Get());
+    Heap::AddFuture(future);
+    return future;
+}
+
+Object* TouchFunction::Invoke(const std::vector<Object*>& args) {
+    RequireNArgs(1, args);
+    Object* evaled = Eval(args[0], CurrentScope::Get());
+    if (!Is<Future>(evaled)) {
+        return evaled;
+    }
+    return As<Future>(evaled)->Touch();
+}
+
+Scope::Scope(Scope* parent) : parent_(parent) {
+}
+
+void Scope::DefineSymbol(const std::string& symbol, Object* obj) {
+    ScopeLock lock(this, true);
+    known_symbols_[symbol] = obj;
+}
+
+Object* Scope::LookUpSymbol(const std::string& symbol) {
+    for (Scope* current = this; current != nullptr; current = current->parent_) {
+        ScopeLock lock(current, false);
+        auto it = current->known_symbols_.find(symbol);
+        if (it != current->known_symbols_.end()) {
+            return it->second;
+        }
+    }
+    throw NameError{std::string() + "Reference to an unknown symbol '" + symbol + "'"};
+}
+
+Scope* Scope::IsDefined(const std::string& symbol) {
+    for (Scope* current = this; current != nullptr; current = current->parent_) {
+        ScopeLock lock(current, false);
+        if (current->known_symbols_.count(symbol)) {
+            return current;
+        }
+    }
+    return nullptr;
+}
+
+Scope* Scope::GetParent() {
+    return parent_;
+}
+
+Scope* Scope::GetGlobal() {
+    Scope* scope = this;
+    while (scope->parent_ != nullptr) {
+        scope = scope->parent_;
+    }
+    return scope;
+}
+
+void Scope::InvalidateFolding() {
+    folding_epoch_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+uint64_t Scope::GetFoldingEpoch() const {
+    return folding_epoch_.load(std::memory_order_acquire);
+}
+
+void Scope::SetParent(Scope* parent) {
+    parent_ = parent;
+}
+
+const std::unordered_map<std::string, Object*>& Scope::GetSymbols() const {
+    return known_symbols_;
+}
+
+CurrentScope::CurrentScope() {
+}
+
+void CurrentScope::Set(Scope* new_scope) {
+    Instance().ptr_ = new_scope;
+}
+
+Scope* CurrentScope::Get() {
+    return Instance().ptr_;
+}
+
+CurrentScope& CurrentScope::Instance() {
+    thread_local CurrentScope sc;
+    return sc;
+}
+
+namespace {
+
+thread_local Heap* active_heap = nullptr;
+
+}  // namespace
+
+// Canonical copies by value. Names and strings are keyed by views of the objects' own
+// storage, the entries go away before the objects do.
+struct InternTable {
+    std::unordered_map<int64_t, Number*> numbers;
+    std::unordered_map<uint64_t, Real*> reals;
+    std::unordered_map<std::string_view, Symbol*> symbols;
+    std::unordered_map<std::string_view, String*> strings;
+    Boolean* booleans[2] = {nullptr, nullptr};
+    std::unordered_map<std::pair<Object*, Object*>, Cell*, PairHash> cells;
+};
+
+Heap::Heap() {
+}
+
+Heap::Activation::Activation(Heap* heap) : previous_(active_heap) {
+    active_heap = heap;
+}
+
+Heap::Activation::~Activation() {
+    active_heap = previous_;
+}
+
+namespace {
+
+// Objects a loop may make before its nursery is collected. A collection goes over the lending
+// heaps too, so it waits for at least as many allocations as they hold objects.
+const size_t kLoopAllocationsBetweenCollections = 1 << 16;
+
+thread_local Heap::LoopNursery* active_loop_nursery = nullptr;
+thread_local uint64_t loop_collections = 0;
+
+}  // namespace
+
+Heap::LoopNursery::LoopNursery()
+    : lender_(&Instance()), enclosing_(active_loop_nursery), previous_(active_loop_nursery),
+      heap_(std::make_unique<Heap>()), activation_(heap_.get()) {
+    if (enclosing_ != nullptr && enclosing_->heap_.get() != lender_) {
+        enclosing_ = nullptr;
+    }
+    // The loop has what is left of the lender's allocation limit
+    heap_->allocation_limit_ = lender_->allocation_limit_ -
+                               std::min(lender_->allocations_, lender_->allocation_limit_);
+    active_loop_nursery = this;
+}
+
+void Heap::LoopNursery::Collect(const std::vector<Object*>& roots) {
+    size_t lent_objects = 0;
+    for (LoopNursery* loop = this; loop != nullptr; loop = loop->enclosing_) {
+        lent_objects += loop->lender_->objs_.size();
+    }
+    // Collections take time in proportion to what is lent and what they keep, so that is
+    // allocated in between at least
+    if (heap_->allocations_ - collected_at_ <
+        std::max({kLoopAllocationsBetweenCollections, lent_objects, survivors_})) {
+        return;
+    }
+    // Besides the roots, the scope of the loop and the objects of the lending heaps that
+    // reference the nursery keep it alive, and the promises all of these reach
+    std::vector<Object*> pending = roots;
+    for (auto& x : heap_->MergeFinishedFutures()) {
+        pending.push_back(x);
+    }
+    if (Scope* scope = CurrentScope::Get()) {
+        pending.push_back(scope);
+        pending.push_back(scope->GetGlobal());
+    }
+    std::vector<Heap*> heaps{heap_.get()};
+    for (LoopNursery* loop = this; loop != nullptr; loop = loop->enclosing_) {
+        loop->lender_->FindReferencesInto(*heap_, &pending);
+        heaps.push_back(loop->lender_);
+    }
+    for (auto& x : heaps) {
+        x->marks_.assign((x->objs_.size() + 63) / 64, 0);
+    }
+    while (!pending.empty()) {
+        Object* obj = pending.back();
+        pending.pop_back();
+        for (auto& x : heaps) {
+            if (obj != nullptr && x->Owns(obj)) {
+                Activation activation(x);
+                obj->Mark();
+                pending.insert(pending.end(), x->mark_stack_.begin(), x->mark_stack_.end());
+                x->mark_stack_.clear();
+                break;
+            }
+        }
+    }
+    heap_->Sweep();
+    ++loop_collections;
+    collected_at_ = heap_->allocations_;
+    survivors_ = heap_->objs_.size() - heap_->free_slots_.size();
+}
+
+uint64_t Heap::LoopNursery::Collections() {
+    return loop_collections;
+}
+
+Heap::LoopNursery::~LoopNursery() {
+    active_loop_nursery = previous_;
+    lender_->Merge(heap_.get());
+    lender_->allocations_ += heap_->allocations_;
+}
+
+Heap& Heap::Instance() {
+    if (active_heap == nullptr) {
+        // Objects made outside of any interpreter live until the thread exits
+        thread_local Heap thread_heap;
+        return thread_heap;
+    }
+    return *active_heap;
+}
+
+void Number::Mark() {
+    TryMark();
+}
+
+void Real::Mark() {
+    TryMark();
+}
+
+void Symbol::Mark() {
+    TryMark();
+}
+
+void Boolean::Mark() {
+    TryMark();
+}
+
+void String::Mark() {
+    TryMark();
+}
+
+void StringBuilder::Mark() {
+    TryMark();
+}
+
+void OutputPort::Mark() {
+    TryMark();
+}
+
+void EofObject::Mark() {
+    TryMark();
+}
+
+void InputPort::Mark() {
+    TryMark();
+}
+
+void Promise::Mark() {
+    if (TryMark()) {
+        auto lock = LockIfConcurrent(mutex_);
+        Heap::MarkLater(expr_);
+        Heap::MarkLater(scope_);
+        Heap::MarkLater(function_);
+        Heap::MarkLater(value_);
+        for (auto& x : args_) {
+            Heap::MarkLater(x);
+        }
+    }
+}
+
+void Cell::Mark() {
+    if (TryMark()) {
+        Heap::MarkLater(first_);
+        Heap::MarkLater(second_);
+    }
+}
+
+Object* SchemaFunction::Apply(const std::vector<Object*>& values) {
+    // Invoke evaluates its arguments, so everything that does not evaluate to itself is
+    // passed as (quote value)
+    std::vector<Object*> args(values.size());
+    QuoteFunction* quote = nullptr;
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (IsNumeric(values[i]) || Is<Boolean>(values[i])) {
+            args[i] = values[i];
+            continue;
+        }
+        if (quote == nullptr) {
+            quote = Heap::Make<QuoteFunction>();
+        }
+        Cell* quoted = Heap::Make<Cell>();
+        quoted->SetFirst(quote);
+        quoted->SetSecond(Heap::Make<Cell>());
+        As<Cell>(quoted->GetSecond())->SetFirst(values[i]);
+        args[i] = quoted;
+    }
+    return Invoke(args);
+}
+
+Object* SchemaFunction::InvokeTail(const std::vector<Object*>& args, TailCall*) {
+    return Invoke(args);
+}
+
+void SchemaFunction::Mark() {
+    TryMark();
+}
+
+void SchemaFunction::SetFoldable() {
+    foldable_ = true;
+}
+
+bool SchemaFunction::IsFoldable() const {
+    return foldable_;
+}
+
+void Scope::Mark() {
+    if (TryMark()) {
+        // A running future may be defining symbols here
+        ScopeLock lock(this, false);
+        for (auto& x : known_symbols_) {
+            Heap::MarkLater(x.second);
+        }
+        Heap::MarkLater(parent_);
+    }
+}
+
+void LambdaImplFunction::Mark() {
+    if (TryMark()) {
+        for (auto& x : cmds_) {
+            Heap::MarkLater(x);
+        }
+        Heap::MarkLater(lsc_);
+    }
+}
+
+void Future::Mark() {
+    if (TryMark()) {
+        Heap::MarkLater(expr_);
+        Heap::MarkLater(scope_);
+        // Until the nursery is merged the value lives there, and the worker may still write it
+        if (merged_) {
+            Heap::MarkLater(value_);
+        }
+    }
+}
+
+void Vector::Mark() {
+    if (TryMark()) {
+        for (auto& x : elements_) {
+            Heap::MarkLater(x);
+        }
+    }
+}
+
+void CaseTable::Mark() {
+    if (TryMark()) {
+        for (auto& x : clauses_) {
+            Heap::MarkLater(x);
+        }
+    }
+}
+
+void FoldedForm::Mark() {
+    if (TryMark()) {
+        Heap::MarkLater(original_);
+        Heap::MarkLater(folded_);
+        Heap::MarkLater(global_);
+    }
+}
+
+void MemoizedFunction::Mark() {
+    if (TryMark()) {
+        auto lock = LockIfConcurrent(mutex_);
+        Heap::MarkLater(function_);
+        for (auto& x : entries_) {
+            for (auto& arg : x.args) {
+                Heap::MarkLater(arg);
+            }
+            Heap::MarkLater(x.value);
+        }
+    }
+}
+
+void HashTable::Mark() {
+    if (TryMark()) {
+        for (auto& x : slots_) {
+            if (x.state == SlotState::FULL) {
+                Heap::MarkLater(x.key);
+                Heap::MarkLater(x.value);
+            }
+        }
+    }
+}
+
+bool Object::TryMark() {
+    return Heap::Instance().SetMark(this);
+}
+
+void Heap::Insert(Object* obj) {
+    if (free_slots_.empty()) {
+        obj->heap_slot_ = objs_.size();
+        objs_.push_back(obj);
+    } else {
+        obj->heap_slot_ = free_slots_.back();
+        free_slots_.pop_back();
+        objs_[obj->heap_slot_] = obj;
+    }
+}
+
+bool Heap::SetMark(Object* obj) {
+    uint32_t slot = obj->heap_slot_;
+    if (slot >= objs_.size() || objs_[slot] != obj) {
+        return false;
+    }
+    uint64_t bit = uint64_t(1) << (slot % 64);
+    if (marks_[slot / 64] & bit) {
+        return false;
+    }
+    marks_[slot / 64] |= bit;
+    return true;
+}
+
+void Heap::MarkLater(Object* obj) {
+    if (obj != nullptr) {
+        Instance().mark_stack_.push_back(obj);
+    }
+}
+
+void Heap::Cleanup(const std::vector<Object*>& roots) {
+    Heap& heap = Instance();
+    std::vector<Future*> pending = heap.MergeFinishedFutures();
+    heap.marks_.assign((heap.objs_.size() + 63) / 64, 0);
+    for (auto& x : roots) {
+        MarkLater(x);
+    }
+    for (auto& x : pending) {
+        MarkLater(x);
+    }
+    while (!heap.mark_stack_.empty()) {
+        Object* obj = heap.mark_stack_.back();
+        heap.mark_stack_.pop_back();
+        obj->Mark();
+    }
+    heap.Sweep();
+}
+
+std::vector<Future*> Heap::MergeFinishedFutures() {
+    // Finished futures hand their nurseries over first, as their values may reference
+    // objects of this heap. A nursery may bring futures of its own.
+    std::vector<Future*> pending;
+    while (!futures_.empty()) {
+        std::vector<Future*> futures;
+        futures.swap(futures_);
+        for (auto& x : futures) {
+            if (x->IsPending()) {
+                pending.push_back(x);
+            } else {
+                x->MergeNursery();
+            }
+        }
+    }
+    futures_ = pending;
+    return pending;
+}
+
+void Heap::Sweep() {
+    if (interned_) {
+        PruneInterned();
+    }
+    for (uint32_t slot = 0; slot < objs_.size(); ++slot) {
+        if (objs_[slot] != nullptr && !(marks_[slot / 64] >> (slot % 64) & 1)) {
+            delete objs_[slot];
+            objs_[slot] = nullptr;
+            free_slots_.push_back(slot);
+        }
+    }
+}
+
+size_t Heap::Allocations() {
+    return Instance().allocations_;
+}
+
+size_t Heap::AllocationLimit() {
+    return Instance().allocation_limit_;
+}
+
+void Heap::SetAllocationLimit(size_t limit) {
+    Instance().allocation_limit_ = limit;
+}
+
+void Heap::ChargeElements(size_t count) {
+    Heap& heap = Instance();
+    if (count > heap.allocation_limit_ - std::min(heap.allocations_, heap.allocation_limit_)) {
+        AllocationLimitExceeded();
+    }
+    heap.allocations_ += count;
+}
+
+void Heap::ChargeBytes(size_t bytes) {
+    ChargeElements(bytes / sizeof(Object*));
+}
+
+void Heap::ChargePayload(String* obj) {
+    ChargeBytes(obj->GetValue().size());
+}
+
+void Heap::ChargePayload(Symbol* obj) {
+    ChargeBytes(obj->GetName().size());
+}
+
+void Heap::AllocationLimitExceeded() {
+    throw LimitError{"Heap limit exceeded"};
+}
+
+void Heap::Merge(Heap* other) {
+    for (auto& x : other->objs_) {
+        if (x != nullptr) {
+            Insert(x);
+        }
+    }
+    other->objs_.clear();
+    other->free_slots_.clear();
+    futures_.insert(futures_.end(), other->futures_.begin(), other->futures_.end());
+    other->futures_.clear();
+    // Where both heaps interned equal objects ours stay canonical, the others are still
+    // immutable but no longer shared with new ones
+    if (other->interned_) {
+        if (!interned_) {
+            interned_ = std::move(other->interned_);
+            return;
+        }
+        InternTable& from = *other->interned_;
+        interned_->numbers.insert(from.numbers.begin(), from.numbers.end());
+        interned_->reals.insert(from.reals.begin(), from.reals.end());
+        interned_->symbols.insert(from.symbols.begin(), from.symbols.end());
+        interned_->strings.insert(from.strings.begin(), from.strings.end());
+        interned_->cells.insert(from.cells.begin(), from.cells.end());
+        for (int i = 0; i < 2; ++i) {
+            if (interned_->booleans[i] == nullptr) {
+                interned_->booleans[i] = from.booleans[i];
+            }
+        }
+        other->interned_.reset();
+    }
+}
+
+void Heap::AddFuture(Future* future) {
+    Instance().futures_.push_back(future);
+}
+
+bool Heap::HasPendingFutures() const {
+    for (auto& x : futures_) {
+        if (x->IsPending()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Heap::Owns(Object* obj) const {
+    return obj->heap_slot_ < objs_.size() && objs_[obj->heap_slot_] == obj;
+}
+
+void Heap::FindReferencesInto(const Heap& nursery, std::vector<Object*>* found) {
+    // Promises are left to the loop to trace, a stream that is walked would otherwise keep
+    // everything it memoized since its head alive
+    Activation activation(this);
+    marks_.assign((objs_.size() + 63) / 64, 0);
+    for (auto& x : objs_) {
+        if (x == nullptr || Is<Promise>(x)) {
+            continue;
+        }
+        x->Mark();
+        for (auto& y : mark_stack_) {
+            if (nursery.Owns(y)) {
+                found->push_back(y);
+            }
+        }
+        mark_stack_.clear();
+    }
+}
+
+namespace {
+
+template <class Map, class Alive>
+void EraseDead(Map* map, Alive alive) {
+    for (auto it = map->begin(); it != map->end();) {
+        if (alive(it->second)) {
+            ++it;
+        } else {
+            it = map->erase(it);
+        }
+    }
+}
+
+}  // namespace
+
+void Heap::PruneInterned() {
+    auto alive = [this](Object* obj) {
+        uint32_t slot = obj->heap_slot_;
+        return marks_[slot / 64] >> (slot % 64) & 1;
+    };
+    InternTable& table = *interned_;
+    EraseDead(&table.numbers, alive);
+    EraseDead(&table.reals, alive);
+    EraseDead(&table.symbols, alive);
+    EraseDead(&table.strings, alive);
+    EraseDead(&table.cells, alive);
+    for (auto& x : table.booleans) {
+        if (x != nullptr && !alive(x)) {
+            x = nullptr;
+        }
+    }
+}
+
+Object* Heap::Intern(Object* root, bool reuse_pairs) {
+    Heap& heap = Instance();
+    if (!heap.interned_) {
+        heap.interned_ = std::make_unique<InternTable>();
+    }
+    InternTable& table = *heap.interned_;
+
+    // Leaves are interned by value. The object itself becomes canonical when this heap
+    // owns it, otherwise a copy does, so the table never references a foreign heap.
+    auto intern_leaf = [&heap, &table](Object* obj) -> Object* {
+        if (Is<Number>(obj)) {
+            int64_t value = As<Number>(obj)->GetValue();
+            auto it = table.numbers.find(value);
+            if (it != table.numbers.end()) {
+                return it->second;
+            }
+            Number* number = heap.Owns(obj) ? As<Number>(obj) : Make<Number>(value);
+            table.numbers.emplace(value, number);
+            return number;
+        } else if (Is<Real>(obj)) {
+            double value = As<Real>(obj)->GetValue();
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            auto it = table.reals.find(bits);
+            if (it != table.reals.end()) {
+                return it->second;
+            }
+            Real* real = heap.Owns(obj) ? As<Real>(obj) : Make<Real>(value);
+            table.reals.emplace(bits, real);
+            return real;
+        } else if (Is<Symbol>(obj)) {
+            auto it = table.symbols.find(As<Symbol>(obj)->GetName());
+            if (it != table.symbols.end()) {
+                return it->second;
+            }
+            Symbol* symbol = heap.Owns(obj) ? As<Symbol>(obj)
+                                            : Make<Symbol>(As<Symbol>(obj)->GetName());
+            table.symbols.emplace(symbol->GetName(), symbol);
+            return symbol;
+        } else if (Is<String>(obj)) {
+            auto it = table.strings.find(As<String>(obj)->GetValue());
+            if (it != table.strings.end()) {
+                return it->second;
+            }
+            String* string = heap.Owns(obj) ? As<String>(obj)
+                                            : Make<String>(As<String>(obj)->GetValue());
+            table.strings.emplace(string->GetValue(), string);
+            return string;
+        } else if (Is<Boolean>(obj)) {
+            bool value = As<Boolean>(obj)->GetValue();
+            Boolean*& canonical = table.booleans[value];
+            if (canonical == nullptr) {
+                canonical = heap.Owns(obj) ? As<Boolean>(obj) : Make<Boolean>(value);
+            }
+            return canonical;
+        }
+        return obj;
+    };
+
+    // Pairs are interned children first, off an explicit stack as long lists are common.
+    // A pair is open from when its children are pushed until it is interned itself, so
+    // meeting an open pair again means it is its own descendant.
+    std::unordered_map<Cell*, Cell*> done;
+    std::unordered_set<Cell*> open;
+    auto canonical = [&](Object* obj) -> Object* {
+        return Is<Cell>(obj) ? done.at(As<Cell>(obj)) : intern_leaf(obj);
+    };
+    auto pending = [&](Object* obj) {
+        if (!Is<Cell>(obj) || done.count(As<Cell>(obj))) {
+            return false;
+        } else if (open.count(As<Cell>(obj))) {
+            throw RuntimeError{"Can not intern a circular structure"};
+        }
+        return true;
+    };
+    std::vector<Cell*> stack;
+    if (Is<Cell>(root)) {
+        stack.push_back(As<Cell>(root));
+    }
+    while (!stack.empty()) {
+        Cell* cell = stack.back();
+        if (cell->interned_) {
+            done.emplace(cell, cell);
+            stack.pop_back();
+        } else if (done.count(cell)) {
+            stack.pop_back();
+        } else if (open.insert(cell).second) {
+            for (Object* child : {cell->second_, cell->first_}) {
+                if (pending(child)) {
+                    stack.push_back(As<Cell>(child));
+                }
+            }
+        } else {
+            stack.pop_back();
+            open.erase(cell);
+            Object* first = canonical(cell->first_);
+            Object* second = canonical(cell->second_);
+            auto key = std::make_pair(first, second);
+            auto it = table.cells.find(key);
+            if (it != table.cells.end()) {
+                done.emplace(cell, it->second);
+                continue;
+            }
+            bool reuse = reuse_pairs && heap.Owns(cell) && cell->first_ == first &&
+                         cell->second_ == second;
+            Cell* result = reuse ? cell : Make<Cell>();
+            result->first_ = first;
+            result->second_ = second;
+            result->interned_ = true;
+            table.cells.emplace(key, result);
+            done.emplace(cell, result);
+        }
+    }
+    return canonical(root);
+}
+
+Heap::~Heap() {
+    // Running futures may still read any of the objects
+    for (auto& x : futures_) {
+        x->Wait();
+    }
     for (auto& x : objs_) {
         delete x;
     }
     objs_.clear();
+    free_slots_.clear();
 }
\ No newline at end of file
@@ -18,6 +18,10 @@ Object* Read(Tokenizer* tokenizer) {
         return Heap::Make<Number>((std::get_if<ConstantToken>(&cur))->value);
     } else if (std::get_if<SymbolToken>(&cur)) {
         return Heap::Make<Symbol>((std::get_if<SymbolToken>(&cur))->name);
+    } else if (std::get_if<RealToken>(&cur)) {
+        return Heap::Make<Real>((std::get_if<RealToken>(&cur))->value);
+    } else if (std::get_if<StringToken>(&cur)) {
+        return Heap::Make<String>((std::get_if<StringToken>(&cur))->value);
     } else if (std::get_if<DotToken>(&cur)) {
         throw SyntaxError{"Unexpected dot token"};
     } else if (std::get_if<BooleanToken>(&cur)) {
@@ -83,3 +87,26 @@ Object* ReadList(Tokenizer* tokenizer) {
     tokenizer->Next();
     return result;
 }
+
+Object* InternQuotedData(Object* form) {
+    // Subforms are pushed rather than recursed into, like everything else walking code
+    std::vector<Object*> pending{form};
+    while (!pending.empty()) {
+        Object* obj = pending.back();
+        pending.pop_back();
+        if (!Is<Cell>(obj)) {
+            continue;
+        }
+        Cell* cell = As<Cell>(obj);
+        if (Is<Symbol>(cell->GetFirst()) && As<Symbol>(cell->GetFirst())->GetName() == "quote" &&
+            Is<Cell>(cell->GetSecond())) {
+            Cell* operand = As<Cell>(cell->GetSecond());
+            operand->SetFirst(Heap::Intern(operand->GetFirst(), true));
+            continue;
+        }
+        for (Object* it = cell; Is<Cell>(it); it = As<Cell>(it)->GetSecond()) {
+            pending.push_back(As<Cell>(it)->GetFirst());
+        }
+    }
+    return form;
+}
@@ -0,0 +1,93 @@
+#include "protocol.h"
+
+#include <cerrno>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+bool ReadFull(int fd, void* data, size_t size) {
+    char* cur = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, cur, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        cur += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool WriteFull(int fd, const void* data, size_t size) {
+    const char* cur = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, cur, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        cur += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool ReadPayload(int fd, std::string* payload) {
+    uint32_t size;
+    if (!ReadFull(fd, &size, sizeof(size))) {
+        return false;
+    }
+    size = ntohl(size);
+    if (size > kMaxFrameSize) {
+        return false;
+    }
+    payload->resize(size);
+    return ReadFull(fd, payload->data(), size);
+}
+
+bool WritePayload(int fd, std::string* frame, const std::string& payload) {
+    uint32_t size = htonl(payload.size());
+    frame->append(reinterpret_cast<const char*>(&size), sizeof(size));
+    *frame += payload;
+    // The header and the payload go out in a single write
+    return WriteFull(fd, frame->data(), frame->size());
+}
+
+}  // namespace
+
+bool ReadRequest(int fd, std::string* expr) {
+    return ReadPayload(fd, expr);
+}
+
+bool WriteRequest(int fd, const std::string& expr) {
+    if (expr.size() > kMaxFrameSize) {
+        return false;
+    }
+    std::string frame;
+    return WritePayload(fd, &frame, expr);
+}
+
+bool ReadResponse(int fd, ResponseStatus* status, std::string* payload) {
+    uint8_t code;
+    if (!ReadFull(fd, &code, sizeof(code)) || code > uint8_t(ResponseStatus::LIMIT_EXCEEDED)) {
+        return false;
+    }
+    *status = ResponseStatus(code);
+    return ReadPayload(fd, payload);
+}
+
+bool WriteResponse(int fd, ResponseStatus status, const std::string& payload) {
+    // The peer would take a larger frame for a malformed one and hang up
+    if (payload.size() > kMaxFrameSize) {
+        return WriteResponse(fd, ResponseStatus::LIMIT_EXCEEDED,
+                             "Result is larger than the frame size limit");
+    }
+    std::string frame(1, char(status));
+    return WritePayload(fd, &frame, payload);
+}
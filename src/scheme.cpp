@@ -1,150 +1,806 @@
 #include "scheme.h"
 #include "tokenizer.h"
 #include "parser.h"
+#include "image.h"
+#include "code_cache.h"
+#include "native.h"
+#include "uvector.h"
 
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
 #include <sstream>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <iostream>
 
+#include <unistd.h>
+
+std::string Serialize(Object* root);
+std::string Display(Object* root);
+
 bool IsProperList(Object* ptr) {
     if (!Is<Cell>(ptr)) {
         return false;
     }
-    Cell* cur = dynamic_cast<Cell*>(ptr);
-    while (cur->GetSecond() != nullptr) {
-        if (!Is<Cell>(cur->GetSecond())) {
-            return false;
+    ListWalker walker(ptr);
+    while (walker.Next() != nullptr) {
+    }
+    return walker.GetTail() == nullptr;
+}
+
+template <class T>
+void Interpreter::DefineUniformVector(const std::string& prefix) {
+    std::string type = prefix + "vector";
+    RegisterFunction(type + "?", [](Object* obj) { return Is<UniformVector<T>>(obj); });
+    DefineBuiltin("make-" + type, Heap::Make<MakeUniformVectorFunction<T>>());
+    DefineBuiltin(type, Heap::Make<UniformVectorFunction<T>>());
+    RegisterFunction(type + "-length", [](UniformVector<T>* vector) {
+        return int64_t(vector->Size());
+    });
+    RegisterFunction(type + "-ref", [](UniformVector<T>* vector, int64_t index) {
+        return UniformElement<T>::To(vector->Get(index));
+    });
+    RegisterFunction(type + "-set!", [](UniformVector<T>* vector, int64_t index, Object* value) {
+        vector->Set(index, UniformElement<T>::From(value));
+    });
+    RegisterFunction("list->" + type, [](Object* list) {
+        std::vector<T> data;
+        for (auto& x : ListToVector(list)) {
+            data.push_back(UniformElement<T>::From(x));
+        }
+        Heap::ChargeBytes(data.size() * sizeof(T));
+        return Heap::Make<UniformVector<T>>(std::move(data));
+    });
+    RegisterFunction(type + "->list", [](UniformVector<T>* vector) {
+        std::vector<Object*> items(vector->Size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            items[i] = UniformElement<T>::To(vector->Data()[i]);
+        }
+        return VectorToList(items);
+    });
+}
+
+Interpreter::Interpreter() : heap_(std::make_unique<Heap>()) {
+    Heap::Activation activation(heap_.get());
+    global_scope_ = Heap::Make<Scope>(nullptr);
+    builtins_ = Heap::Make<Scope>(nullptr);
+    RegisterFunction("boolean?", [](Object* obj) { return Is<Boolean>(obj); });
+    RegisterFunction("not", [](bool value) { return !value; });
+    RegisterFunction("number?", [](Object* obj) { return IsNumeric(obj); });
+    RegisterFunction("real?", [](Object* obj) { return IsNumeric(obj); });
+    RegisterFunction("integer?", [](Object* obj) {
+        return Is<Number>(obj) || (Is<Real>(obj) && std::trunc(ToDouble(obj)) == ToDouble(obj));
+    });
+    RegisterFunction("exact?", [](Object* obj) {
+        if (!IsNumeric(obj)) {
+            throw RuntimeError{"Invalid parameter type"};
+        }
+        return Is<Number>(obj);
+    });
+    RegisterFunction("inexact?", [](Object* obj) {
+        if (!IsNumeric(obj)) {
+            throw RuntimeError{"Invalid parameter type"};
         }
-        cur = dynamic_cast<Cell*>(cur->GetSecond());
+        return Is<Real>(obj);
+    });
+    RegisterFunction("exact->inexact", [](double value) { return value; });
+    RegisterFunction("inexact->exact", [](double value) {
+        if (!std::isfinite(value) || std::round(value) != value) {
+            throw RuntimeError{"Number has no exact representation"};
+        }
+        // Converting a double outside [-2^63, 2^63) to int64_t is undefined
+        if (value < -9223372036854775808.0 || value >= 9223372036854775808.0) {
+            throw RuntimeError{"Number is out of the exact integer range"};
+        }
+        return int64_t(value);
+    });
+    RegisterFunction("floor", [](Object* obj) -> Object* {
+        if (Is<Number>(obj)) {
+            return obj;
+        }
+        return Heap::Make<Real>(std::floor(NativeArg<double>::From(obj)));
+    });
+    RegisterFunction("sqrt", [](double value) { return std::sqrt(value); });
+    DefineBuiltin("=", Heap::Make<NumberEqFunction>());
+    DefineBuiltin("<", Heap::Make<NumberLeFunction>());
+    DefineBuiltin("<=", Heap::Make<NumberLeqFunction>());
+    DefineBuiltin(">", Heap::Make<NumberGeFunction>());
+    DefineBuiltin(">=", Heap::Make<NumberGeqFunction>());
+    DefineBuiltin("+", Heap::Make<AddFunction>());
+    DefineBuiltin("-", Heap::Make<SubFunction>());
+    DefineBuiltin("/", Heap::Make<DivFunction>());
+    DefineBuiltin("*", Heap::Make<MulFunction>());
+    DefineBuiltin("max", Heap::Make<MaxFunction>());
+    DefineBuiltin("min", Heap::Make<MinFunction>());
+    RegisterFunction("abs", [](Object* obj) -> Object* {
+        if (Is<Number>(obj)) {
+            int64_t value = As<Number>(obj)->GetValue();
+            return Heap::Make<Number>(value < 0 ? -value : value);
+        }
+        return Heap::Make<Real>(std::fabs(NativeArg<double>::From(obj)));
+    });
+    DefineBuiltin("quote", Heap::Make<QuoteFunction>());
+    DefineBuiltin("and", Heap::Make<AndFunction>());
+    DefineBuiltin("or", Heap::Make<OrFunction>());
+    DefineBuiltin("pair?", Heap::Make<IsPairFunction>());
+    RegisterFunction("null?", [](Object* obj) { return obj == nullptr; });
+    DefineBuiltin("list?", Heap::Make<IsListFunction>());
+    RegisterFunction("cons", [](Object* first, Object* second) { return Cons(first, second); });
+    RegisterFunction("car", [](Cell* cell) { return cell->GetFirst(); });
+    RegisterFunction("cdr", [](Cell* cell) { return cell->GetSecond(); });
+    DefineBuiltin("list", Heap::Make<MakeListFunction>());
+    DefineBuiltin("list-tail", Heap::Make<ListTailFunction>());
+    DefineBuiltin("list-ref", Heap::Make<ListRefFunction>());
+    RegisterFunction("length", [](Object* list) { return int64_t(ListLength(list)); });
+    DefineBuiltin("append", Heap::Make<AppendFunction>());
+    RegisterFunction("reverse", [](Object* list) { return ReverseList(list); });
+    RegisterFunction("list-copy", [](Object* list) { return CopyList(list); });
+    RegisterFunction("last-pair", [](Object* list) { return LastPair(list); });
+    RegisterFunction("memq", [](Object* obj, Object* list) { return Member(obj, list, IsEq); });
+    RegisterFunction("memv", [](Object* obj, Object* list) { return Member(obj, list, IsEqv); });
+    RegisterFunction("member", [](Object* obj, Object* list) {
+        return Member(obj, list, IsEqual);
+    });
+    RegisterFunction("assq", [](Object* obj, Object* alist) { return Assoc(obj, alist, IsEq); });
+    RegisterFunction("assv", [](Object* obj, Object* alist) { return Assoc(obj, alist, IsEqv); });
+    RegisterFunction("assoc", [](Object* obj, Object* alist) {
+        return Assoc(obj, alist, IsEqual);
+    });
+    RegisterFunction("eq?", [](Object* a, Object* b) { return IsEq(a, b); });
+    RegisterFunction("eqv?", [](Object* a, Object* b) { return IsEqv(a, b); });
+    RegisterFunction("equal?", [](Object* a, Object* b) { return IsEqual(a, b); });
+    DefineBuiltin("map", Heap::Make<MapFunction>());
+    DefineBuiltin("for-each", Heap::Make<ForEachFunction>());
+    DefineBuiltin("filter", Heap::Make<FilterFunction>());
+    DefineBuiltin("fold-left", Heap::Make<FoldLeftFunction>());
+    DefineBuiltin("fold-right", Heap::Make<FoldRightFunction>());
+    DefineBuiltin("reduce", Heap::Make<ReduceFunction>());
+    DefineBuiltin("apply", Heap::Make<ApplyFunction>());
+    RegisterFunction("symbol?", [](Object* obj) { return Is<Symbol>(obj); });
+    RegisterFunction("vector?", [](Object* obj) { return Is<Vector>(obj); });
+    DefineBuiltin("make-vector", Heap::Make<MakeVectorFunction>());
+    DefineBuiltin("vector", Heap::Make<VectorFunction>());
+    RegisterFunction("vector-length", [](Vector* vector) { return int64_t(vector->Size()); });
+    RegisterFunction("vector-ref", [](Vector* vector, int64_t index) { return vector->Get(index); });
+    RegisterFunction("vector-set!", [](Vector* vector, int64_t index, Object* value) {
+        vector->Set(index, value);
+    });
+    RegisterFunction("vector-fill!", [](Vector* vector, Object* value) { vector->Fill(value); });
+    RegisterFunction("list->vector", [](Object* list) {
+        return Heap::Make<Vector>(ListToVector(list));
+    });
+    RegisterFunction("vector->list", [](Vector* vector) {
+        return VectorToList(vector->GetElements());
+    });
+    RegisterFunction("string?", [](Object* obj) { return Is<String>(obj); });
+    RegisterFunction("string-length", [](String* s) { return int64_t(s->GetValue().size()); });
+    // There is no character type, a character is a string of length one
+    RegisterFunction("string-ref", [](String* s, int64_t index) {
+        if (index < 0 || static_cast<uint64_t>(index) >= s->GetValue().size()) {
+            throw RuntimeError{"String index out of range"};
+        }
+        return Heap::Make<String>(std::string(1, s->GetValue()[index]));
+    });
+    DefineBuiltin("substring", Heap::Make<SubstringFunction>());
+    DefineBuiltin("string-append", Heap::Make<StringAppendFunction>());
+    RegisterFunction("string=?", [](String* a, String* b) {
+        return a->GetValue() == b->GetValue();
+    });
+    RegisterFunction("string->symbol", [](String* s) { return Heap::Make<Symbol>(s->GetValue()); });
+    RegisterFunction("symbol->string", [](Symbol* s) { return Heap::Make<String>(s->GetName()); });
+    RegisterFunction("number->string", [](Object* obj) {
+        if (!IsNumeric(obj)) {
+            throw RuntimeError{"Invalid parameter type"};
+        }
+        return Heap::Make<String>(Serialize(obj));
+    });
+    RegisterFunction("make-string-builder", [] { return Heap::Make<StringBuilder>(); });
+    RegisterFunction("string-builder-append!", [](StringBuilder* builder, String* s) {
+        builder->Append(s->GetValue());
+    });
+    RegisterFunction("string-builder->string", [](StringBuilder* builder) {
+        return Heap::Make<String>(builder->GetValue());
+    });
+    DefineUniformVector<uint8_t>("u8");
+    DefineUniformVector<int64_t>("s64");
+    DefineUniformVector<double>("f64");
+    RegisterFunction("uvector-sum", [](Object* vector) {
+        return WithUniformVector(vector, [](auto* v) {
+            return NativeResult(KernelSum(v->Data(), v->Size()));
+        });
+    });
+    RegisterFunction("uvector-min", [](Object* vector) {
+        return WithUniformVector(vector, [](auto* v) {
+            if (v->Size() == 0) {
+                throw RuntimeError{"Minimum of an empty vector"};
+            }
+            return UniformElement<std::decay_t<decltype(*v->Data())>>::To(
+                KernelMin(v->Data(), v->Size()));
+        });
+    });
+    RegisterFunction("uvector-max", [](Object* vector) {
+        return WithUniformVector(vector, [](auto* v) {
+            if (v->Size() == 0) {
+                throw RuntimeError{"Maximum of an empty vector"};
+            }
+            return UniformElement<std::decay_t<decltype(*v->Data())>>::To(
+                KernelMax(v->Data(), v->Size()));
+        });
+    });
+    RegisterFunction("uvector-dot", [](Object* a, Object* b) {
+        return WithUniformVector(a, [b](auto* v) {
+            return NativeResult(KernelDot(v->Data(), SameShape(v, b)->Data(), v->Size()));
+        });
+    });
+    RegisterFunction("uvector-add", [](Object* a, Object* b) {
+        return WithUniformVector(a, [b](auto* v) -> Object* {
+            using Vector = std::remove_pointer_t<decltype(v)>;
+            Heap::ChargeBytes(v->Size() * sizeof(*v->Data()));
+            Vector* result = Heap::Make<Vector>(std::vector(v->Data(), v->Data() + v->Size()));
+            KernelAdd(v->Data(), SameShape(v, b)->Data(), result->Data(), v->Size());
+            return result;
+        });
+    });
+    RegisterFunction("uvector-mul", [](Object* a, Object* b) {
+        return WithUniformVector(a, [b](auto* v) -> Object* {
+            using Vector = std::remove_pointer_t<decltype(v)>;
+            Heap::ChargeBytes(v->Size() * sizeof(*v->Data()));
+            Vector* result = Heap::Make<Vector>(std::vector(v->Data(), v->Data() + v->Size()));
+            KernelMul(v->Data(), SameShape(v, b)->Data(), result->Data(), v->Size());
+            return result;
+        });
+    });
+    RegisterFunction("uvector-scale", [](Object* a, Object* k) {
+        return WithUniformVector(a, [k](auto* v) -> Object* {
+            using Vector = std::remove_pointer_t<decltype(v)>;
+            using Element = std::decay_t<decltype(*v->Data())>;
+            Heap::ChargeBytes(v->Size() * sizeof(*v->Data()));
+            Vector* result = Heap::Make<Vector>(std::vector(v->Data(), v->Data() + v->Size()));
+            KernelScale(v->Data(), UniformElement<Element>::From(k), result->Data(), v->Size());
+            return result;
+        });
+    });
+    RegisterFunction("hash-table?", [](Object* obj) { return Is<HashTable>(obj); });
+    RegisterFunction("make-hash-table", [] { return Heap::Make<HashTable>(); });
+    RegisterFunction("hash-table-set!", [](HashTable* table, Object* key, Object* value) {
+        table->Insert(key, value);
+    });
+    DefineBuiltin("hash-table-ref", Heap::Make<HashTableRefFunction>());
+    RegisterFunction("hash-table-delete!", [](HashTable* table, Object* key) {
+        return table->Remove(key);
+    });
+    RegisterFunction("hash-table-count", [](HashTable* table) { return int64_t(table->Count()); });
+    RegisterFunction("hash-table-keys", [](HashTable* table) {
+        std::vector<Object*> keys;
+        for (auto& x : table->Entries()) {
+            keys.push_back(x.first);
+        }
+        return VectorToList(keys);
+    });
+    RegisterFunction("hash-table-values", [](HashTable* table) {
+        std::vector<Object*> values;
+        for (auto& x : table->Entries()) {
+            values.push_back(x.second);
+        }
+        return VectorToList(values);
+    });
+    RegisterFunction("hash-table->alist", [](HashTable* table) {
+        std::vector<Object*> pairs;
+        for (auto& x : table->Entries()) {
+            Cell* pair = Heap::Make<Cell>();
+            pair->SetFirst(x.first);
+            pair->SetSecond(x.second);
+            pairs.push_back(pair);
+        }
+        return VectorToList(pairs);
+    });
+    // Walks a snapshot, so the procedure may modify the table
+    RegisterFunction("hash-table-walk", [](HashTable* table, SchemaFunction* function) {
+        for (auto& x : table->Entries()) {
+            function->Apply({x.first, x.second});
+        }
+    });
+    DefineBuiltin("define", Heap::Make<DefineFunction>());
+    DefineBuiltin("if", Heap::Make<IfFunction>());
+    DefineBuiltin("begin", Heap::Make<BeginFunction>());
+    DefineBuiltin("let", Heap::Make<LetFunction>());
+    DefineBuiltin("let*", Heap::Make<LetStarFunction>());
+    DefineBuiltin("letrec", Heap::Make<LetrecFunction>());
+    DefineBuiltin("do", Heap::Make<DoFunction>());
+    DefineBuiltin("cond", Heap::Make<CondFunction>());
+    DefineBuiltin("case", Heap::Make<CaseFunction>());
+    DefineBuiltin("set!", Heap::Make<SetFunction>());
+    RegisterFunction("set-car!", [](Cell* cell, Object* obj) {
+        if (cell->IsInterned()) {
+            throw RuntimeError{"Can not mutate an interned list"};
+        }
+        cell->SetFirst(obj);
+    });
+    RegisterFunction("set-cdr!", [](Cell* cell, Object* obj) {
+        if (cell->IsInterned()) {
+            throw RuntimeError{"Can not mutate an interned list"};
+        }
+        cell->SetSecond(obj);
+    });
+    DefineBuiltin("display", Heap::Make<DisplayFunction>());
+    DefineBuiltin("write", Heap::Make<WriteFunction>());
+    DefineBuiltin("newline", Heap::Make<NewlineFunction>());
+    DefineBuiltin("flush-output", Heap::Make<FlushOutputFunction>());
+    RegisterFunction("current-output-port", [] { return OutputPort::Stdout(); });
+    RegisterFunction("open-output-string", [] { return Heap::Make<OutputPort>(); });
+    RegisterFunction("get-output-string", [](OutputPort* port) {
+        if (!port->IsStringPort()) {
+            throw RuntimeError{"Expected a string port"};
+        }
+        return Heap::Make<String>(port->GetString());
+    });
+    RegisterFunction("output-port?", [](Object* obj) { return Is<OutputPort>(obj); });
+    RegisterFunction("open-input-file", [](String* path) {
+        return Heap::Make<InputPort>(path->GetValue());
+    });
+    RegisterFunction("close-input-port", [](InputPort* port) { port->Close(); });
+    RegisterFunction("input-port?", [](Object* obj) { return Is<InputPort>(obj); });
+    RegisterFunction("read-line", [](InputPort* port) -> Object* {
+        auto line = port->ReadLine();
+        if (!line) {
+            return EofObject::Get();
+        }
+        return Heap::Make<String>(std::string(*line));
+    });
+    // Data read with hash-consing on is interned like quoted data
+    RegisterFunction("read", [this](InputPort* port) {
+        Object* datum = port->ReadDatum();
+        return hash_consing_ ? Heap::Intern(datum, true) : datum;
+    });
+    RegisterFunction("eof-object", [] { return EofObject::Get(); });
+    RegisterFunction("eof-object?", [](Object* obj) { return Is<EofObject>(obj); });
+    // Lines only become strings as they are passed on, nothing else of the file is copied.
+    // The lines and whatever the function made of them are collected as the loop goes.
+    RegisterFunction("for-each-line", [](SchemaFunction* function, InputPort* port) {
+        Heap::LoopNursery nursery;
+        while (auto line = port->ReadLine()) {
+            function->Apply({Heap::Make<String>(std::string(*line))});
+            nursery.Collect({function});
+        }
+    });
+    RegisterFunction("fold-lines", [](SchemaFunction* function, Object* init, InputPort* port) {
+        Heap::LoopNursery nursery;
+        Object* result = init;
+        while (auto line = port->ReadLine()) {
+            result = function->Apply({result, Heap::Make<String>(std::string(*line))});
+            nursery.Collect({function, result});
+        }
+        return result;
+    });
+    DefineBuiltin("delay", Heap::Make<DelayFunction>());
+    DefineBuiltin("cons-stream", Heap::Make<ConsStreamFunction>());
+    RegisterFunction("make-promise", [](Object* obj) -> Object* {
+        return Is<Promise>(obj) ? obj : Heap::Make<Promise>(obj);
+    });
+    RegisterFunction("force", [](Object* obj) {
+        return Is<Promise>(obj) ? As<Promise>(obj)->Force() : obj;
+    });
+    RegisterFunction("promise?", [](Object* obj) { return Is<Promise>(obj); });
+    RegisterFunction("stream-pair?", [](Object* obj) {
+        return Is<Cell>(obj) && Is<Promise>(As<Cell>(obj)->GetSecond());
+    });
+    RegisterFunction("stream-null?", [](Object* obj) { return ForceStream(obj) == nullptr; });
+    RegisterFunction("stream-car", [](Object* obj) {
+        Object* stream = ForceStream(obj);
+        if (stream == nullptr) {
+            throw RuntimeError{"Expected a non-empty stream"};
+        }
+        return As<Cell>(stream)->GetFirst();
+    });
+    RegisterFunction("stream-cdr", [](Object* obj) {
+        Object* stream = ForceStream(obj);
+        if (stream == nullptr) {
+            throw RuntimeError{"Expected a non-empty stream"};
+        }
+        return ForceStream(As<Cell>(stream)->GetSecond());
+    });
+    DefineBuiltin("stream-map", Heap::Make<StreamMapFunction>());
+    DefineBuiltin("stream-filter", Heap::Make<StreamFilterFunction>());
+    DefineBuiltin("stream-take", Heap::Make<StreamTakeFunction>());
+    DefineBuiltin("line-stream", Heap::Make<LineStreamFunction>());
+    // The cells walked past are collected unless something else still references them
+    RegisterFunction("stream->list", [](Object* obj) {
+        std::vector<Object*> items;
+        Heap::LoopNursery nursery;
+        for (Object* stream = ForceStream(obj); stream != nullptr;
+             stream = ForceStream(As<Cell>(stream)->GetSecond())) {
+            items.push_back(As<Cell>(stream)->GetFirst());
+            // The cell the loop goes on from is a root for as long as the collection takes
+            items.push_back(stream);
+            nursery.Collect(items);
+            items.pop_back();
+        }
+        return VectorToList(items);
+    });
+    RegisterFunction("hash-cons", [](Object* obj) { return Heap::Intern(obj); });
+    DefineBuiltin("lambda", Heap::Make<LambdaFunction>());
+    DefineBuiltin("memoize", Heap::Make<MemoizeFunction>());
+    DefineBuiltin("define-memoized", Heap::Make<DefineMemoizedFunction>());
+    RegisterFunction("memoize-clear!", [](MemoizedFunction* function) { function->Clear(); });
+    RegisterFunction("memoize-count", [](MemoizedFunction* function) {
+        return int64_t(function->Count());
+    });
+    DefineBuiltin("parallel-map", Heap::Make<ParallelMapFunction>());
+    DefineBuiltin("parallel-for-each", Heap::Make<ParallelForEachFunction>());
+    DefineBuiltin("future", Heap::Make<FutureFunction>());
+    DefineBuiltin("touch", Heap::Make<TouchFunction>());
+
+    // Functions of constants without side effects, and the special forms that the folding
+    // of definitions knows, see FoldConstants
+    for (const char* name :
+         {"boolean?", "not", "number?", "real?", "integer?", "exact?", "inexact?",
+          "exact->inexact", "inexact->exact", "floor", "sqrt", "=", "<", "<=", ">", ">=", "+",
+          "-", "/", "*", "max", "min", "abs", "symbol?", "string?", "string-length",
+          "string-append", "string=?", "substring", "number->string", "eq?", "eqv?", "equal?",
+          "null?", "pair?", "list?", "quote", "lambda", "define", "define-memoized", "set!",
+          "let", "let*", "letrec", "do", "cond", "case", "if", "and", "or", "begin"}) {
+        As<SchemaFunction>(builtins_->LookUpSymbol(name))->SetFoldable();
     }
-    return true;
 }
 
-bool IsImproperList(Object* ptr) {
-    if (!Is<Cell>(ptr)) {
-        return false;
+void CancellationToken::Cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+void CancellationToken::Reset() {
+    cancelled_.store(false, std::memory_order_relaxed);
+}
+
+bool CancellationToken::IsCancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+}
+
+void Interpreter::DefineBuiltin(const std::string& name, Object* function) {
+    // A registered function may replace one the folds of this interpreter relied on. While
+    // the constructor sets up the builtins nothing has been folded yet.
+    global_scope_->InvalidateFolding();
+    builtins_->DefineSymbol(name, function);
+    global_scope_->DefineSymbol(name, function);
+}
+
+void Interpreter::SaveImage(const std::string& path) {
+    Heap::Activation activation(heap_.get());
+    BuiltinNames names;
+    for (auto& x : builtins_->GetSymbols()) {
+        names[x.second] = x.first;
     }
-    Cell* cur = dynamic_cast<Cell*>(ptr);
-    while (Is<Cell>(cur->GetSecond())) {
-        cur = dynamic_cast<Cell*>(cur->GetSecond());
+    WriteImageFile(path, {global_scope_}, names);
+}
+
+void Interpreter::LoadImage(const std::string& path) {
+    Heap::Activation activation(heap_.get());
+    auto roots = ReadImageFile(path, builtins_->GetSymbols());
+    if (roots.size() != 1 || !Is<Scope>(roots[0])) {
+        throw RuntimeError{"Image does not contain a global scope"};
     }
-    return cur->GetSecond() != nullptr;
+    global_scope_ = As<Scope>(roots[0]);
+    Heap::Cleanup({global_scope_, builtins_});
 }
 
-Interpreter::Interpreter() {
-    global_scope_ = Heap::Make<Scope>(nullptr);
-    global_scope_->DefineSymbol("boolean?", Heap::Make<IsBooleanFunction>());
-    global_scope_->DefineSymbol("not", Heap::Make<NotFunction>());
-    global_scope_->DefineSymbol("number?", Heap::Make<IsNumberFunction>());
-    global_scope_->DefineSymbol("=", Heap::Make<NumberEqFunction>());
-    global_scope_->DefineSymbol("<", Heap::Make<NumberLeFunction>());
-    global_scope_->DefineSymbol("<=", Heap::Make<NumberLeqFunction>());
-    global_scope_->DefineSymbol(">", Heap::Make<NumberGeFunction>());
-    global_scope_->DefineSymbol(">=", Heap::Make<NumberGeqFunction>());
-    global_scope_->DefineSymbol("+", Heap::Make<AddFunction>());
-    global_scope_->DefineSymbol("-", Heap::Make<SubFunction>());
-    global_scope_->DefineSymbol("/", Heap::Make<DivFunction>());
-    global_scope_->DefineSymbol("*", Heap::Make<MulFunction>());
-    global_scope_->DefineSymbol("max", Heap::Make<MaxFunction>());
-    global_scope_->DefineSymbol("min", Heap::Make<MinFunction>());
-    global_scope_->DefineSymbol("abs", Heap::Make<AbsFunction>());
-    global_scope_->DefineSymbol("quote", Heap::Make<QuoteFunction>());
-    global_scope_->DefineSymbol("and", Heap::Make<AndFunction>());
-    global_scope_->DefineSymbol("or", Heap::Make<OrFunction>());
-    global_scope_->DefineSymbol("pair?", Heap::Make<IsPairFunction>());
-    global_scope_->DefineSymbol("null?", Heap::Make<IsNullFunction>());
-    global_scope_->DefineSymbol("list?", Heap::Make<IsListFunction>());
-    global_scope_->DefineSymbol("cons", Heap::Make<ConsFunction>());
-    global_scope_->DefineSymbol("car", Heap::Make<CarFunction>());
-    global_scope_->DefineSymbol("cdr", Heap::Make<CdrFunction>());
-    global_scope_->DefineSymbol("list", Heap::Make<MakeListFunction>());
-    global_scope_->DefineSymbol("list-tail", Heap::Make<ListTailFunction>());
-    global_scope_->DefineSymbol("list-ref", Heap::Make<ListRefFunction>());
-    global_scope_->DefineSymbol("symbol?", Heap::Make<IsSymbolFunction>());
-    global_scope_->DefineSymbol("define", Heap::Make<DefineFunction>());
-    global_scope_->DefineSymbol("if", Heap::Make<IfFunction>());
-    global_scope_->DefineSymbol("set!", Heap::Make<SetFunction>());
-    global_scope_->DefineSymbol("set-car!", Heap::Make<SetCarFunction>());
-    global_scope_->DefineSymbol("set-cdr!", Heap::Make<SetCdrFunction>());
-    global_scope_->DefineSymbol("lambda", Heap::Make<LambdaFunction>());
+pid_t Interpreter::Fork() {
+    if (heap_->HasPendingFutures()) {
+        throw RuntimeError{"Can not fork while futures are running"};
+    }
+    // Otherwise both processes would write out what was buffered before the fork
+    OutputPort::Stdout()->Flush();
+    return ForkProcess();
+}
+
+// The limits of a Run as seen by the futures and parallel-map chunks it starts, which
+// may outlive the Run: they run under a copy of its limits, and are cancelled once the
+// Run ends. Every task may take as many steps and allocations as the Run itself.
+struct TaskLimits {
+    RunLimits limits;
+    // The cancellation of the copy, cancelled when the Run ends
+    CancellationToken ended;
+    std::mutex mutex;
+    // The token of the Run, for as long as it lasts
+    const CancellationToken* caller = nullptr;
+
+    // Passes a cancellation of the Run on to the tasks
+    void CheckCaller() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (caller != nullptr && caller->IsCancelled()) {
+            ended.Cancel();
+        }
+    }
+};
+
+namespace {
+
+// Limits of the Run in progress on this thread, if it has any
+thread_local const RunLimits* active_limits = nullptr;
+thread_local size_t eval_depth = 0;
+// What tasks started by that Run run under, and the limits of the task running on this
+// thread, if any
+thread_local std::shared_ptr<TaskLimits> active_task_limits;
+thread_local TaskLimits* running_task_limits = nullptr;
+
+// Calls are counted down to the next check, which then accounts for all of them at once
+thread_local uint64_t steps_taken = 0;
+thread_local uint64_t steps_since_check = 0;
+thread_local uint64_t steps_until_check = 0;
+
+// Reading the clock or the token on every call would dominate cheap calls
+const uint64_t kStepsBetweenChecks = 1024;
+
+void ScheduleCheck() {
+    steps_since_check = kStepsBetweenChecks;
+    if (active_limits->step_budget) {
+        // Land exactly on the first call over the budget
+        steps_since_check = std::min(steps_since_check, *active_limits->step_budget + 1 - steps_taken);
+    }
+    steps_until_check = steps_since_check;
+}
+
+void CheckLimits() {
+    if (running_task_limits != nullptr) {
+        running_task_limits->CheckCaller();
+    }
+    steps_taken += steps_since_check;
+    if (active_limits->step_budget && steps_taken > *active_limits->step_budget) {
+        throw LimitError{"Step budget exhausted"};
+    }
+    if (active_limits->cancellation && active_limits->cancellation->IsCancelled()) {
+        throw LimitError{"Evaluation was cancelled"};
+    }
+    if (active_limits->deadline && std::chrono::steady_clock::now() > *active_limits->deadline) {
+        throw LimitError{"Time limit exceeded"};
+    }
+    ScheduleCheck();
+}
+
+// Tracks the nesting of Eval while limits are active
+class DepthGuard {
+private:
+    bool counted_ = false;
+
+public:
+    DepthGuard() {
+        if (active_limits == nullptr || active_limits->max_depth == 0) {
+            return;
+        }
+        if (eval_depth >= active_limits->max_depth) {
+            throw LimitError{"Recursion depth limit exceeded"};
+        }
+        ++eval_depth;
+        counted_ = true;
+    }
+
+    ~DepthGuard() {
+        if (counted_) {
+            --eval_depth;
+        }
+    }
+};
+
+class LimitsActivation {
+private:
+    const RunLimits* previous_limits_;
+    std::shared_ptr<TaskLimits> previous_task_limits_;
+    size_t previous_allocation_limit_;
+
+public:
+    LimitsActivation(const RunLimits* limits)
+        : previous_limits_(active_limits), previous_task_limits_(active_task_limits),
+          previous_allocation_limit_(Heap::AllocationLimit()) {
+        active_limits = limits;
+        steps_taken = 0;
+        ScheduleCheck();
+        if (limits->max_allocations != 0) {
+            Heap::SetAllocationLimit(Heap::Allocations() + limits->max_allocations);
+        }
+        active_task_limits = std::make_shared<TaskLimits>();
+        active_task_limits->limits = *limits;
+        active_task_limits->limits.cancellation = &active_task_limits->ended;
+        active_task_limits->caller = limits->cancellation;
+    }
+
+    ~LimitsActivation() {
+        // Tasks still running are stopped at their next check
+        {
+            std::lock_guard<std::mutex> lock(active_task_limits->mutex);
+            active_task_limits->caller = nullptr;
+        }
+        active_task_limits->ended.Cancel();
+        active_task_limits = previous_task_limits_;
+        active_limits = previous_limits_;
+        Heap::SetAllocationLimit(previous_allocation_limit_);
+    }
+};
+
+// Installs the limits of a task on this thread, and restores what was active before,
+// e.g. when a thread waiting for tasks runs one of them
+class TaskLimitsActivation {
+private:
+    const RunLimits* previous_limits_ = active_limits;
+    std::shared_ptr<TaskLimits> previous_task_limits_ = active_task_limits;
+    TaskLimits* previous_running_ = running_task_limits;
+    uint64_t previous_steps_[3] = {steps_taken, steps_since_check, steps_until_check};
+    size_t previous_allocation_limit_ = Heap::AllocationLimit();
+
+public:
+    // Without limits the task runs unlimited, whatever the thread was running before
+    TaskLimitsActivation(const std::shared_ptr<TaskLimits>& limits) {
+        active_limits = limits ? &limits->limits : nullptr;
+        active_task_limits = limits;
+        running_task_limits = limits.get();
+        steps_taken = 0;
+        if (limits == nullptr) {
+            return;
+        }
+        ScheduleCheck();
+        // The task allocates into a heap of its own
+        if (limits->limits.max_allocations != 0) {
+            Heap::SetAllocationLimit(Heap::Allocations() + limits->limits.max_allocations);
+        }
+    }
+
+    ~TaskLimitsActivation() {
+        active_limits = previous_limits_;
+        active_task_limits = previous_task_limits_;
+        running_task_limits = previous_running_;
+        steps_taken = previous_steps_[0];
+        steps_since_check = previous_steps_[1];
+        steps_until_check = previous_steps_[2];
+        Heap::SetAllocationLimit(previous_allocation_limit_);
+    }
+};
+
+}  // namespace
+
+std::shared_ptr<TaskLimits> CurrentTaskLimits() {
+    return active_task_limits;
+}
+
+void RunWithLimits(const std::shared_ptr<TaskLimits>& limits, const std::function<void()>& task) {
+    TaskLimitsActivation activation(limits);
+    task();
+}
+
+// Counts a step against the limits, for loops that may evaluate nothing else per iteration
+void CountStep() {
+    if (active_limits != nullptr && --steps_until_check == 0) {
+        CheckLimits();
+    }
 }
 
 Object* Eval(Object* root, Scope* scope) {
-    if (Is<Cell>(root)) {
-        std::vector<Object*> invocation_params;
-        Cell::BoarIterator it = Cell::BoarIterator(dynamic_cast<Cell*>(root));
-        if (it.Get() != nullptr) {
-            invocation_params.push_back(it.Get());
-            while (it.Advance()) {
+    DepthGuard depth_guard;
+    Scope* entry_scope = scope;
+    for (;;) {
+        // A call that leaves an expression in tail position continues the loop with it, so
+        // tail calls don't nest
+        while (Is<Cell>(root)) {
+            CountStep();
+            std::vector<Object*> invocation_params;
+            Cell::BoarIterator it = Cell::BoarIterator(dynamic_cast<Cell*>(root));
+            if (it.Get() != nullptr) {
                 invocation_params.push_back(it.Get());
+                while (it.Advance()) {
+                    invocation_params.push_back(it.Get());
+                }
+                if (invocation_params.back() == nullptr) {
+                    invocation_params.pop_back();
+                }
+                // Now I have a list of objects to be evaluated
+                // I therefore require the first param to be a string
+                Object* evaled_first = Eval(invocation_params[0], scope);
+                if (!Is<SchemaFunction>(evaled_first)) {
+                    throw RuntimeError{
+                        "Could not evaluate a list without its first param being a function"};
+                }
+                // Fix : do not evaluate all the params
+                // Evaluate the first param to get the function
+                CurrentScope::Set(scope);
+                SchemaFunction* invocable = As<SchemaFunction>(evaled_first);
+                invocation_params.erase(invocation_params.begin());
+                TailCall tail;
+                tail.call = As<Cell>(root);
+                auto result = invocable->InvokeTail(invocation_params, &tail);
+                CurrentScope::Set(entry_scope);
+                if (tail.scope == nullptr) {
+                    return result;
+                }
+                root = tail.expr;
+                scope = tail.scope;
+            } else {
+                // I'm literally an empty list
+                throw RuntimeError{"Could not evaluate an empty list"};
             }
-            if (invocation_params.back() == nullptr) {
-                invocation_params.pop_back();
-            }
-            // Now I have a list of objects to be evaluated
-            // I therefore require the first param to be a string
-            Object* evaled_first = Eval(invocation_params[0], scope);
-            if (!Is<SchemaFunction>(evaled_first)) {
-                throw RuntimeError{
-                    "Could not evaluate a list without its first param being a function"};
-            }
-            // Fix : do not evaluate all the params
-            // Evaluate the first param to get the function
-            CurrentScope::Set(scope);
-            SchemaFunction* invocable = As<SchemaFunction>(evaled_first);
-            invocation_params.erase(invocation_params.begin());
-            auto result = invocable->Invoke(invocation_params);
-            CurrentScope::Set(scope);
-            return result;
+        }
+        if (Is<Number>(root)) {
+            return root;
+        } else if (Is<Symbol>(root)) {
+            // Return some kind of a function object
+            std::string symb = As<Symbol>(root)->GetName();
+            return scope->LookUpSymbol(symb);
+        } else if (Is<Boolean>(root)) {
+            return root;
+        } else if (Is<Real>(root) || Is<String>(root) || Is<Vector>(root) || Is<U8Vector>(root) ||
+                   Is<S64Vector>(root) || Is<F64Vector>(root)) {
+            return root;
+        } else if (Is<SchemaFunction>(root)) {
+            return root;
+        } else if (Is<FoldedForm>(root)) {
+            // Evaluated in place of the folded expression, which may be a call in tail position
+            root = As<FoldedForm>(root)->Select();
+            continue;
         } else {
-            // I'm literally an empty list
-            throw RuntimeError{"Could not evaluate an empty list"};
+            throw RuntimeError{"I fucked up with parsing somehow (or smth other?)"};
         }
-    } else if (Is<Number>(root)) {
-        return root;
-    } else if (Is<Symbol>(root)) {
-        // Return some kind of a function object
-        std::string symb = As<Symbol>(root)->GetName();
-        return scope->LookUpSymbol(symb);
-    } else if (Is<Boolean>(root)) {
-        return root;
-    } else {
-        throw RuntimeError{"I fucked up with parsing somehow (or smth other?)"};
     }
 }
 
-std::string Serialize(Object* root) {
-    if (Is<Cell>(root)) {
-        std::vector<Object*> invocation_params;
-        Cell::BoarIterator it = Cell::BoarIterator(dynamic_cast<Cell*>(root));
-        invocation_params.push_back(it.Get());
-        while (it.Advance()) {
-            invocation_params.push_back(it.Get());
-        }
-        if (invocation_params.back() == nullptr) {
-            invocation_params.pop_back();
-        }
-        if (IsProperList(root)) {
-            std::string result = "(";
-            for (auto& x : invocation_params) {
-                result += Serialize(x);
-                result += " ";
-            }
-            result.back() = ')';
-            return result;
-        } else if (IsImproperList(root)) {
-            std::string result = "(";
-            for (size_t i = 0; i < invocation_params.size() - 1; ++i) {
-                result += Serialize(invocation_params[i]);
-                result += " ";
-            }
-            result += ". ";
-            result += Serialize(invocation_params.back());
-            result += ")";
-            return result;
+namespace {
+
+// The string as a literal that reads back to it
+std::string WriteString(const std::string& value) {
+    std::string result = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (c == '\n') {
+            result += "\\n";
+        } else if (c == '\t') {
+            result += "\\t";
+        } else {
+            result += c;
         }
-    } else if (Is<Number>(root)) {
+    }
+    return result + "\"";
+}
+
+// The shortest form that reads back to the same double, always with a point or exponent
+// so that it reads back as a real
+std::string WriteReal(double value) {
+    if (std::isnan(value)) {
+        return "+nan.0";
+    } else if (std::isinf(value)) {
+        return value > 0 ? "+inf.0" : "-inf.0";
+    }
+    char buffer[32];
+    for (int precision = 15; precision <= 17; ++precision) {
+        std::snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (std::strtod(buffer, nullptr) == value) {
+            break;
+        }
+    }
+    std::string result = buffer;
+    if (result.find_first_of(".e") == std::string::npos) {
+        result += ".0";
+    }
+    return result;
+}
+
+template <class T>
+std::string WriteUniformVector(const std::string& prefix, UniformVector<T>* vector) {
+    std::string result = prefix;
+    for (size_t i = 0; i < vector->Size(); ++i) {
+        if (i > 0) {
+            result += " ";
+        }
+        if constexpr (std::is_floating_point_v<T>) {
+            result += WriteReal(vector->Data()[i]);
+        } else {
+            result += std::to_string(vector->Data()[i]);
+        }
+    }
+    return result + ")";
+}
+
+// Text of an atom as write prints it, or as display does: strings without quotes
+std::string PrintAtom(Object* root, bool display) {
+    if (Is<Number>(root)) {
         return std::to_string(As<Number>(root)->GetValue());
     } else if (Is<Symbol>(root)) {
         return As<Symbol>(root)->GetName();
@@ -152,6 +808,30 @@ std::string Serialize(Object* root) {
         return std::string() + "#" + (As<Boolean>(root)->GetValue() ? "t" : "f");
     } else if (Is<SchemaFunction>(root)) {
         throw RuntimeError{"Tried to serialize a function"};
+    } else if (Is<Real>(root)) {
+        return WriteReal(As<Real>(root)->GetValue());
+    } else if (Is<String>(root)) {
+        return display ? As<String>(root)->GetValue() : WriteString(As<String>(root)->GetValue());
+    } else if (Is<StringBuilder>(root)) {
+        return "#<string-builder>";
+    } else if (Is<U8Vector>(root)) {
+        return WriteUniformVector("#u8(", As<U8Vector>(root));
+    } else if (Is<S64Vector>(root)) {
+        return WriteUniformVector("#s64(", As<S64Vector>(root));
+    } else if (Is<F64Vector>(root)) {
+        return WriteUniformVector("#f64(", As<F64Vector>(root));
+    } else if (Is<HashTable>(root)) {
+        return "#<hash-table>";
+    } else if (Is<Future>(root)) {
+        return "#<future>";
+    } else if (Is<OutputPort>(root)) {
+        return "#<output-port>";
+    } else if (Is<InputPort>(root)) {
+        return "#<input-port>";
+    } else if (Is<EofObject>(root)) {
+        return "#<eof>";
+    } else if (Is<Promise>(root)) {
+        return "#<promise>";
     } else if (root == nullptr) {
         return "()";
     } else {
@@ -159,16 +839,183 @@ std::string Serialize(Object* root) {
     }
 }
 
+// Text of an object as write prints it, or as display does. Nested lists and vectors are
+// walked with a stack of pending items rather than by recursion, so deep data can't overflow
+// the stack of the thread; under limits their nesting is held to max_depth.
+std::string Print(Object* root, bool display) {
+    // Either an object still to print or text to append, a closing one ends a nesting level
+    struct Item {
+        Object* obj;
+        const char* text;
+        bool closes;
+    };
+    std::vector<Item> pending{{root, nullptr, false}};
+    std::string result;
+    size_t depth = 0;
+    size_t max_depth = active_limits != nullptr ? active_limits->max_depth : 0;
+    auto open = [&](const char* prefix) {
+        if (max_depth != 0 && ++depth > max_depth) {
+            throw LimitError{"Recursion depth limit exceeded"};
+        }
+        result += prefix;
+    };
+    // Queues the items in order, separated by spaces and before the closing text
+    auto queue = [&](const std::vector<Object*>& items, Object* tail, const char* close) {
+        pending.push_back({nullptr, close, true});
+        if (tail != nullptr) {
+            pending.push_back({tail, nullptr, false});
+            pending.push_back({nullptr, " . ", false});
+        }
+        for (size_t i = items.size(); i-- > 0;) {
+            pending.push_back({items[i], nullptr, false});
+            if (i > 0) {
+                pending.push_back({nullptr, " ", false});
+            }
+        }
+    };
+    while (!pending.empty()) {
+        Item item = pending.back();
+        pending.pop_back();
+        if (item.text != nullptr) {
+            result += item.text;
+            depth -= item.closes ? 1 : 0;
+            continue;
+        }
+        Object* obj = item.obj;
+        if (Is<Cell>(obj)) {
+            ListWalker walker(obj);
+            while (walker.Next() != nullptr) {
+            }
+            if (walker.IsCyclic()) {
+                throw RuntimeError{"Tried to serialize a circular list"};
+            }
+            std::vector<Object*> items;
+            Object* tail = obj;
+            while (Is<Cell>(tail)) {
+                items.push_back(As<Cell>(tail)->GetFirst());
+                tail = As<Cell>(tail)->GetSecond();
+            }
+            open("(");
+            queue(items, tail, ")");
+        } else if (Is<Vector>(obj)) {
+            open("#(");
+            queue(As<Vector>(obj)->GetElements(), nullptr, ")");
+        } else if (Is<CaseTable>(obj)) {
+            pending.push_back({As<CaseTable>(obj)->GetSource(), nullptr, false});
+        } else if (Is<FoldedForm>(obj)) {
+            pending.push_back({As<FoldedForm>(obj)->GetOriginal(), nullptr, false});
+        } else {
+            result += PrintAtom(obj, display);
+        }
+    }
+    return result;
+}
+
+}  // namespace
+
+std::string Serialize(Object* root) {
+    return Print(root, false);
+}
+
+std::string Display(Object* root) {
+    return Print(root, true);
+}
+
 std::string Interpreter::Run(const std::string& s) {
-    std::stringstream ss;
-    ss << s;
-    Tokenizer tkn(&ss);
+    return Run(s, RunLimits());
+}
+
+namespace {
+
+// Objects a batch may make before it collects garbage in between its expressions
+const size_t kBatchAllocationsBetweenCollections = 1 << 20;
+
+bool HasLimits(const RunLimits& limits) {
+    return limits.deadline || limits.step_budget || limits.cancellation != nullptr ||
+           limits.max_allocations != 0 || limits.max_depth != 0;
+}
+
+// Parses and evaluates a single expression, the stream is reused between calls
+std::string EvalExpression(std::stringstream* ss, const std::string& s, Scope* scope,
+                           bool hash_consing) {
+    ss->clear();
+    ss->str(s);
+    Tokenizer tkn(ss);
     Object* root = Read(&tkn);
     if (!tkn.IsEnd()) {
         throw SyntaxError{"Provided string is not a valid executable expression"};
     }
-    Object* result = Eval(root, global_scope_);
-    std::string serialized_result = Serialize(result);
-    Heap::Cleanup(global_scope_);
+    if (hash_consing) {
+        InternQuotedData(root);
+    }
+    return Serialize(Eval(root, scope));
+}
+
+}  // namespace
+
+std::string Interpreter::Run(const std::string& s, const RunLimits& limits) {
+    Heap::Activation activation(heap_.get());
+    std::optional<LimitsActivation> limits_activation;
+    if (HasLimits(limits)) {
+        limits_activation.emplace(&limits);
+    }
+    std::string serialized_result;
+    try {
+        std::stringstream ss;
+        serialized_result = EvalExpression(&ss, s, global_scope_, hash_consing_);
+    } catch (...) {
+        // Whatever the failed evaluation made is garbage now
+        limits_activation.reset();
+        Heap::Cleanup({global_scope_, builtins_});
+        throw;
+    }
+    limits_activation.reset();
+    Heap::Cleanup({global_scope_, builtins_});
     return serialized_result;
 }
+
+std::vector<std::string> Interpreter::RunBatch(const std::vector<std::string>& exprs) {
+    return RunBatch(exprs, RunLimits());
+}
+
+std::vector<std::string> Interpreter::RunBatch(const std::vector<std::string>& exprs,
+                                               const RunLimits& limits) {
+    Heap::Activation activation(heap_.get());
+    std::optional<LimitsActivation> limits_activation;
+    if (HasLimits(limits)) {
+        limits_activation.emplace(&limits);
+    }
+    std::vector<std::string> results;
+    results.reserve(exprs.size());
+    try {
+        std::stringstream ss;
+        size_t collected_at = Heap::Allocations();
+        for (auto& x : exprs) {
+            results.push_back(EvalExpression(&ss, x, global_scope_, hash_consing_));
+            // Results are serialized already, so only the scopes are live in between
+            if (Heap::Allocations() - collected_at > kBatchAllocationsBetweenCollections) {
+                Heap::Cleanup({global_scope_, builtins_});
+                collected_at = Heap::Allocations();
+            }
+        }
+    } catch (...) {
+        limits_activation.reset();
+        Heap::Cleanup({global_scope_, builtins_});
+        throw;
+    }
+    limits_activation.reset();
+    Heap::Cleanup({global_scope_, builtins_});
+    return results;
+}
+
+void Interpreter::SetHashConsing(bool enabled) {
+    hash_consing_ = enabled;
+}
+
+void Interpreter::Load(const std::string& path) {
+    Heap::Activation activation(heap_.get());
+    for (auto& x : ReadSourceFile(path)) {
+        Eval(hash_consing_ ? InternQuotedData(x) : x, global_scope_);
+    }
+    Heap::Cleanup({global_scope_, builtins_});
+}
@@ -0,0 +1,226 @@
+#include "server.h"
+#include "protocol.h"
+#include "scheme.h"
+#include "error.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+// How long an isolated request may take past its time limit before its child is killed.
+// The child enforces the limit itself, this only catches a child that hangs.
+const std::chrono::milliseconds kIsolatedGracePeriod{1000};
+
+// How long the server waits before accepting again when it ran out of resources
+const std::chrono::milliseconds kAcceptBackoff{100};
+
+// Waits until fd is readable or the timeout passes, returns whether it is readable
+bool WaitReadable(int fd, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        pollfd pfd{fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, std::max<int64_t>(0, left.count()));
+        if (ready >= 0 || errno != EINTR) {
+            return ready > 0;
+        }
+    }
+}
+
+class InterpreterPool {
+private:
+    std::vector<std::unique_ptr<Interpreter>> interpreters_;
+    std::vector<Interpreter*> free_;
+    std::mutex mutex_;
+    std::condition_variable released_;
+
+public:
+    InterpreterPool(const ServerOptions& options) {
+        size_t size = options.interpreters;
+        if (size == 0) {
+            size = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < size; ++i) {
+            interpreters_.push_back(std::make_unique<Interpreter>());
+            interpreters_.back()->SetHashConsing(options.hash_cons);
+            if (!options.image.empty()) {
+                interpreters_.back()->LoadImage(options.image);
+            }
+            for (auto& x : options.files) {
+                interpreters_.back()->Load(x);
+            }
+            free_.push_back(interpreters_.back().get());
+        }
+    }
+
+    Interpreter* Acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        released_.wait(lock, [this] { return !free_.empty(); });
+        Interpreter* result = free_.back();
+        free_.pop_back();
+        return result;
+    }
+
+    void Release(Interpreter* interpreter) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(interpreter);
+        }
+        released_.notify_one();
+    }
+};
+
+ResponseStatus RunRequest(Interpreter* interpreter, const ServerOptions& options,
+                          const std::string& expr, std::string* result) {
+    RunLimits limits;
+    limits.deadline = std::chrono::steady_clock::now() + options.time_limit;
+    limits.max_allocations = options.heap_limit;
+    limits.max_depth = options.depth_limit;
+    ResponseStatus status = ResponseStatus::OK;
+    try {
+        *result = interpreter->Run(expr, limits);
+    } catch (const SyntaxError& err) {
+        status = ResponseStatus::SYNTAX_ERROR;
+        *result = err.what();
+    } catch (const RuntimeError& err) {
+        status = ResponseStatus::RUNTIME_ERROR;
+        *result = err.what();
+    } catch (const NameError& err) {
+        status = ResponseStatus::NAME_ERROR;
+        *result = err.what();
+    } catch (const LimitError& err) {
+        status = ResponseStatus::LIMIT_EXCEEDED;
+        *result = err.what();
+    } catch (const std::exception& err) {
+        // E.g. bad_alloc, which must not take the server and its other connections down
+        status = ResponseStatus::RUNTIME_ERROR;
+        *result = err.what();
+    } catch (...) {
+        status = ResponseStatus::RUNTIME_ERROR;
+        *result = "Evaluation failed";
+    }
+    return status;
+}
+
+// Runs the request in a forked copy of the interpreter, which sends the response back
+// over a socket pair and exits. Nothing the request does survives it.
+ResponseStatus RunIsolated(Interpreter* interpreter, const ServerOptions& options,
+                           const std::string& expr, std::string* result) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        *result = "Could not isolate the request";
+        return ResponseStatus::RUNTIME_ERROR;
+    }
+    pid_t pid = -1;
+    try {
+        pid = interpreter->Fork();
+    } catch (const RuntimeError& err) {
+        *result = err.what();
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        ResponseStatus status = RunRequest(interpreter, options, expr, result);
+        _exit(WriteResponse(fds[1], status, *result) ? 0 : 1);
+    }
+    close(fds[1]);
+    ResponseStatus status = ResponseStatus::RUNTIME_ERROR;
+    if (pid < 0) {
+        if (result->empty()) {
+            *result = "Could not isolate the request";
+        }
+    } else if (!WaitReadable(fds[0], options.time_limit + kIsolatedGracePeriod)) {
+        kill(pid, SIGKILL);
+        status = ResponseStatus::LIMIT_EXCEEDED;
+        *result = "Time limit exceeded";
+    } else if (!ReadResponse(fds[0], &status, result)) {
+        status = ResponseStatus::RUNTIME_ERROR;
+        *result = "Evaluation crashed";
+    }
+    close(fds[0]);
+    if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+    }
+    return status;
+}
+
+ResponseStatus Evaluate(InterpreterPool* pool, const ServerOptions& options,
+                        const std::string& expr, std::string* result) {
+    result->clear();
+    Interpreter* interpreter = pool->Acquire();
+    ResponseStatus status = options.isolate ? RunIsolated(interpreter, options, expr, result)
+                                            : RunRequest(interpreter, options, expr, result);
+    pool->Release(interpreter);
+    return status;
+}
+
+void ServeConnection(InterpreterPool* pool, const ServerOptions& options, int fd) {
+    std::string expr;
+    std::string result;
+    while (ReadRequest(fd, &expr)) {
+        ResponseStatus status = Evaluate(pool, options, expr, &result);
+        if (!WriteResponse(fd, status, result)) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+}  // namespace
+
+int RunServer(const ServerOptions& options) {
+    std::unique_ptr<InterpreterPool> pool;
+    try {
+        pool = std::make_unique<InterpreterPool>(options);
+    } catch (const std::exception& err) {
+        std::cerr << "Could not initialize interpreters: " << err.what() << std::endl;
+        return 1;
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (options.socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path is too long" << std::endl;
+        return 1;
+    }
+    std::strcpy(addr.sun_path, options.socket_path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(options.socket_path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        std::cerr << "Could not listen on '" << options.socket_path
+                  << "': " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Out of descriptors or memory until connections close, the listener stays
+                // readable meanwhile so retrying at once would only spin
+                std::this_thread::sleep_for(kAcceptBackoff);
+            } else if (errno != EINTR && errno != ECONNABORTED && errno != EPROTO &&
+                       errno != EAGAIN) {
+                std::cerr << "Could not accept connections: " << std::strerror(errno)
+                          << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        std::thread(ServeConnection, pool.get(), std::cref(options), fd).detach();
+    }
+}
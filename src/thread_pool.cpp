@@ -0,0 +1,197 @@
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstdlib>
+
+#include <pthread.h>
+
+namespace {
+
+// The pool and queue the calling thread works for, if it is a worker
+thread_local ThreadPool* worker_pool = nullptr;
+thread_local size_t worker_index = 0;
+
+std::mutex instance_mutex;
+std::unique_ptr<ThreadPool> instance;
+
+void BeforeFork() {
+    instance_mutex.lock();
+}
+
+void AfterForkInParent() {
+    instance_mutex.unlock();
+}
+
+void AfterForkInChild() {
+    // The workers did not survive fork and the queues may be locked by them, so the old
+    // pool can't even be destroyed. The child gets a fresh pool when it first needs one.
+    instance.release();
+    instance_mutex.unlock();
+}
+
+size_t DefaultThreads() {
+    if (const char* env = std::getenv("SCHEME_THREADS")) {
+        long threads = std::strtol(env, nullptr, 10);
+        if (threads > 0) {
+            return threads;
+        }
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wakeup_.notify_all();
+    for (auto& x : workers_) {
+        x.join();
+    }
+}
+
+ThreadPool& ThreadPool::Instance() {
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    if (!instance) {
+        static bool registered =
+            (pthread_atfork(BeforeFork, AfterForkInParent, AfterForkInChild), true);
+        (void)registered;
+        instance = std::make_unique<ThreadPool>(DefaultThreads());
+    }
+    return *instance;
+}
+
+size_t ThreadPool::Size() const {
+    return workers_.size();
+}
+
+void ThreadPool::Submit(Task task) {
+    size_t index = worker_pool == this ? worker_index : next_queue_++ % queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        ++pending_;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    wakeup_.notify_one();
+}
+
+bool ThreadPool::TryPop(size_t preferred, Task* task) {
+    {
+        Queue& own = *queues_[preferred];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            *task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        Queue& victim = *queues_[(preferred + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            *task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::RunPending() {
+    Task task;
+    size_t preferred = worker_pool == this ? worker_index : 0;
+    if (!TryPop(preferred, &task)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        --pending_;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    worker_pool = this;
+    worker_index = index;
+    while (true) {
+        if (RunPending()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wakeup_.wait(lock, [this] { return stop_ || pending_ > 0; });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool) : pool_(pool) {
+}
+
+TaskGroup::~TaskGroup() {
+    try {
+        Wait();
+    } catch (...) {
+    }
+}
+
+void TaskGroup::Run(ThreadPool::Task task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++remaining_;
+    }
+    pool_.Submit([this, task = std::move(task)] {
+        std::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error && !error_) {
+            error_ = error;
+        }
+        if (--remaining_ == 0) {
+            done_.notify_all();
+        }
+    });
+}
+
+void TaskGroup::Wait() {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (remaining_ == 0) {
+                break;
+            }
+        }
+        if (pool_.RunPending()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Other tasks may be queued in the meantime, so only nap briefly
+        done_.wait_for(lock, std::chrono::milliseconds(1), [this] { return remaining_ == 0; });
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
@@ -1,5 +1,7 @@
 #include <tokenizer.h>
 
+#include <cstdlib>
+
 SymbolToken::SymbolToken(const std::string& name) : name(name) {
 }
 
@@ -22,6 +24,20 @@ bool ConstantToken::operator==(const ConstantToken& other) const {
     return value == other.value;
 }
 
+RealToken::RealToken(double value) : value(value) {
+}
+
+bool RealToken::operator==(const RealToken& other) const {
+    return value == other.value;
+}
+
+StringToken::StringToken(const std::string& value) : value(value) {
+}
+
+bool StringToken::operator==(const StringToken& other) const {
+    return value == other.value;
+}
+
 bool Tokenizer::IsStartForSymbol(char nc) {
     return std::isalpha(nc) || nc == '<' || nc == '=' || nc == '>' || nc == '*' || nc == '/' ||
            nc == '#';
@@ -33,6 +49,8 @@ bool Tokenizer::IsInnerForSymbol(char nc) {
 }
 
 void Tokenizer::ParseTokenAndStore() {
+    // Asks the buffer rather than tellg, which fails once the stream hit its end
+    consumed_ = in_->rdbuf()->pubseekoff(0, std::ios::cur, std::ios::in);
     char c = in_->peek();
     while (std::isspace(c)) {
         in_->get();
@@ -56,6 +74,13 @@ void Tokenizer::ParseTokenAndStore() {
         in_->get();
         current_token_ = BracketToken::CLOSE;
         return;
+    } else if (c == '"') {
+        in_->get();
+        current_token_ = StringToken(ParseString());
+        return;
+    } else if (AtFraction()) {
+        current_token_ = ParseNumber(false);
+        return;
     } else if (c == '.') {
         in_->get();
         current_token_ = DotToken();
@@ -64,15 +89,8 @@ void Tokenizer::ParseTokenAndStore() {
     // left options are boolean, number of a string
     // dumb check : strings are not permitted to start with numbers
     if (std::isdigit(c)) {
-        // then this is for sure a number, read the numbers while valid
-        int64_t current = 0;
-        while (std::isdigit(c)) {
-            c = in_->get();
-            current = 10 * current + c - 48;
-            c = in_->peek();
-        }
-        // not a number anymore, end
-        current_token_ = ConstantToken(current);
+        // then this is for sure a number
+        current_token_ = ParseNumber(false);
         return;
     } else {
         if (c == '#') {
@@ -119,38 +137,24 @@ void Tokenizer::ParseTokenAndStore() {
             // either positive integer or a string
             c = in_->get();
             char nc = in_->peek();
-            if (!std::isdigit(nc)) {
+            if (!std::isdigit(nc) && !AtFraction()) {
                 current_token_ = SymbolToken("+");
                 return;
             } else {
-                // it's a positive integer
-                int64_t current = 0;
-                while (std::isdigit(nc)) {
-                    nc = in_->get();
-                    current = 10 * current + nc - 48;
-                    nc = in_->peek();
-                }
-                // not a number anymore, end
-                current_token_ = ConstantToken(current);
+                // it's a positive number
+                current_token_ = ParseNumber(false);
                 return;
             }
         } else if (c == '-') {
             // either negative integer or a string
             c = in_->get();
             char nc = in_->peek();
-            if (!std::isdigit(nc)) {
+            if (!std::isdigit(nc) && !AtFraction()) {
                 current_token_ = SymbolToken("-");
                 return;
             } else {
-                // it's a positive integer
-                int64_t current = 0;
-                while (std::isdigit(nc)) {
-                    nc = in_->get();
-                    current = 10 * current + nc - 48;
-                    nc = in_->peek();
-                }
-                // not a number anymore, end
-                current_token_ = ConstantToken(-current);
+                // it's a negative number
+                current_token_ = ParseNumber(true);
                 return;
             }
         } else {
@@ -175,6 +179,81 @@ void Tokenizer::ParseTokenAndStore() {
     }
 }
 
+bool Tokenizer::AtFraction() {
+    if (in_->peek() != '.') {
+        return false;
+    }
+    in_->get();
+    bool digit = std::isdigit(in_->peek());
+    in_->unget();
+    return digit;
+}
+
+Token Tokenizer::ParseNumber(bool negative) {
+    std::string digits = negative ? "-" : "";
+    int64_t current = 0;
+    while (std::isdigit(in_->peek())) {
+        char c = in_->get();
+        digits += c;
+        current = 10 * current + c - 48;
+    }
+    bool real = false;
+    if (in_->peek() == '.') {
+        real = true;
+        digits += in_->get();
+        while (std::isdigit(in_->peek())) {
+            digits += in_->get();
+        }
+    }
+    if (in_->peek() == 'e' || in_->peek() == 'E') {
+        real = true;
+        digits += in_->get();
+        if (in_->peek() == '+' || in_->peek() == '-') {
+            digits += in_->get();
+        }
+        if (!std::isdigit(in_->peek())) {
+            throw SyntaxError{"Malformed exponent in a number"};
+        }
+        while (std::isdigit(in_->peek())) {
+            digits += in_->get();
+        }
+    }
+    if (real) {
+        return RealToken(std::strtod(digits.c_str(), nullptr));
+    }
+    return ConstantToken(negative ? -current : current);
+}
+
+std::string Tokenizer::ParseString() {
+    std::string result;
+    while (true) {
+        int c = in_->get();
+        if (c == EOF) {
+            throw SyntaxError{"Unterminated string literal"};
+        } else if (c == '"') {
+            return result;
+        } else if (c == '\\') {
+            c = in_->get();
+            switch (c) {
+                case 'n':
+                    result += '\n';
+                    break;
+                case 't':
+                    result += '\t';
+                    break;
+                case '"':
+                case '\\':
+                    result += char(c);
+                    break;
+                default:
+                    throw SyntaxError{"Unknown escape sequence in a string literal"};
+            }
+        } else {
+            result += char(c);
+        }
+    }
+}
+
 Tokenizer::Tokenizer(std::istream* in) : in_(in) {
     ParseTokenAndStore();
 }
@@ -190,3 +269,7 @@ void Tokenizer::Next() {
 Token Tokenizer::GetToken() {
     return current_token_;
 }
+
+std::streamoff Tokenizer::Consumed() const {
+    return consumed_;
+}
@@ -0,0 +1,367 @@
+#include "uvector_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__ELF__)
+#include <immintrin.h>
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+// The vector types never cross a call boundary, every helper taking them is inlined
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+namespace {
+
+// 256-bit vectors, which the baseline build splits into pairs of SSE2 registers. The
+// generic kernels below are inlined into every clone and compiled for its instruction set.
+typedef uint8_t U8x32 __attribute__((vector_size(32)));
+typedef uint32_t U32x32 __attribute__((vector_size(128)));
+typedef uint64_t U64x4 __attribute__((vector_size(32)));
+typedef int64_t S64x4 __attribute__((vector_size(32)));
+typedef double F64x4 __attribute__((vector_size(32)));
+
+template <class T>
+struct Simd;
+
+template <>
+struct Simd<uint8_t> {
+    using Vec = U8x32;
+};
+
+// Wrapping arithmetic is done on the unsigned type, signed overflow is undefined
+template <>
+struct Simd<uint64_t> {
+    using Vec = U64x4;
+};
+
+template <>
+struct Simd<int64_t> {
+    using Vec = S64x4;
+};
+
+template <>
+struct Simd<double> {
+    using Vec = F64x4;
+};
+
+#define INLINE inline __attribute__((always_inline))
+
+template <class V, class T>
+INLINE V Load(const T* p) {
+    V v;
+    std::memcpy(&v, p, sizeof(V));
+    return v;
+}
+
+template <class T, class V>
+INLINE void Store(T* p, const V& v) {
+    std::memcpy(p, &v, sizeof(V));
+}
+
+template <class T, class V>
+INLINE T HorizontalSum(const V& v) {
+    T result = 0;
+    for (size_t i = 0; i < sizeof(V) / sizeof(v[0]); ++i) {
+        result += v[i];
+    }
+    return result;
+}
+
+// Two accumulators, so consecutive additions don't wait for each other
+template <class T>
+INLINE T Sum(const T* a, size_t n) {
+    using V = typename Simd<T>::Vec;
+    constexpr size_t kLanes = sizeof(V) / sizeof(T);
+    V acc0 = {};
+    V acc1 = {};
+    size_t i = 0;
+    for (; i + 2 * kLanes <= n; i += 2 * kLanes) {
+        acc0 += Load<V>(a + i);
+        acc1 += Load<V>(a + i + kLanes);
+    }
+    T result = HorizontalSum<T>(acc0 + acc1);
+    for (; i < n; ++i) {
+        result += a[i];
+    }
+    return result;
+}
+
+template <class T>
+INLINE T Dot(const T* a, const T* b, size_t n) {
+    using V = typename Simd<T>::Vec;
+    constexpr size_t kLanes = sizeof(V) / sizeof(T);
+    V acc0 = {};
+    V acc1 = {};
+    size_t i = 0;
+    for (; i + 2 * kLanes <= n; i += 2 * kLanes) {
+        acc0 += Load<V>(a + i) * Load<V>(b + i);
+        acc1 += Load<V>(a + i + kLanes) * Load<V>(b + i + kLanes);
+    }
+    T result = HorizontalSum<T>(acc0 + acc1);
+    for (; i < n; ++i) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+// Bytes are widened to 32-bit lanes, which are flushed before they could overflow
+[[maybe_unused]] INLINE int64_t SumBytes(const uint8_t* a, size_t n) {
+    const size_t kBlocksPerFlush = 1 << 24;
+    uint64_t result = 0;
+    size_t i = 0;
+    while (i + 32 <= n) {
+        U32x32 acc = {};
+        size_t end = std::min(n - n % 32, i + 32 * kBlocksPerFlush);
+        for (; i < end; i += 32) {
+            acc += __builtin_convertvector(Load<U8x32>(a + i), U32x32);
+        }
+        result += HorizontalSum<uint64_t>(acc);
+    }
+    for (; i < n; ++i) {
+        result += a[i];
+    }
+    return result;
+}
+
+INLINE int64_t DotBytes(const uint8_t* a, const uint8_t* b, size_t n) {
+    const size_t kBlocksPerFlush = 1 << 16;
+    uint64_t result = 0;
+    size_t i = 0;
+    while (i + 32 <= n) {
+        U32x32 acc = {};
+        size_t end = std::min(n - n % 32, i + 32 * kBlocksPerFlush);
+        for (; i < end; i += 32) {
+            acc += __builtin_convertvector(Load<U8x32>(a + i), U32x32) *
+                   __builtin_convertvector(Load<U8x32>(b + i), U32x32);
+        }
+        result += HorizontalSum<uint64_t>(acc);
+    }
+    for (; i < n; ++i) {
+        result += uint32_t(a[i]) * b[i];
+    }
+    return result;
+}
+
+template <class T, class Pick>
+INLINE T Reduce(const T* a, size_t n, Pick pick) {
+    using V = typename Simd<T>::Vec;
+    constexpr size_t kLanes = sizeof(V) / sizeof(T);
+    T result = a[0];
+    size_t i = 0;
+    if (n >= kLanes) {
+        V acc = Load<V>(a);
+        for (i = kLanes; i + kLanes <= n; i += kLanes) {
+            acc = pick(acc, Load<V>(a + i));
+        }
+        for (size_t j = 0; j < kLanes; ++j) {
+            result = pick(result, acc[j]);
+        }
+    }
+    for (; i < n; ++i) {
+        result = pick(result, a[i]);
+    }
+    return result;
+}
+
+struct PickMin {
+    template <class V>
+    INLINE V operator()(const V& a, const V& b) const {
+        return b < a ? b : a;
+    }
+};
+
+struct PickMax {
+    template <class V>
+    INLINE V operator()(const V& a, const V& b) const {
+        return a < b ? b : a;
+    }
+};
+
+template <class T, class Op>
+INLINE void Map(const T* a, const T* b, T* out, size_t n, Op op) {
+    using V = typename Simd<T>::Vec;
+    constexpr size_t kLanes = sizeof(V) / sizeof(T);
+    size_t i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        Store(out + i, op(Load<V>(a + i), Load<V>(b + i)));
+    }
+    for (; i < n; ++i) {
+        out[i] = op(a[i], b[i]);
+    }
+}
+
+template <class T>
+INLINE void Scale(const T* a, T k, T* out, size_t n) {
+    using V = typename Simd<T>::Vec;
+    constexpr size_t kLanes = sizeof(V) / sizeof(T);
+    V factor = V{} + k;
+    size_t i = 0;
+    for (; i + kLanes <= n; i += kLanes) {
+        Store(out + i, Load<V>(a + i) * factor);
+    }
+    for (; i < n; ++i) {
+        out[i] = a[i] * k;
+    }
+}
+
+struct Plus {
+    template <class V>
+    INLINE V operator()(const V& a, const V& b) const {
+        return a + b;
+    }
+};
+
+struct Times {
+    template <class V>
+    INLINE V operator()(const V& a, const V& b) const {
+        return a * b;
+    }
+};
+
+// Signed elements go through their unsigned counterpart for wrapping arithmetic
+const uint64_t* Unsigned(const int64_t* p) {
+    return reinterpret_cast<const uint64_t*>(p);
+}
+
+uint64_t* Unsigned(int64_t* p) {
+    return reinterpret_cast<uint64_t*>(p);
+}
+
+}  // namespace
+
+#if defined(__x86_64__) && defined(__ELF__)
+
+// Summing bytes is worth the sum of absolute differences against zero, which adds up
+// eight bytes at a time without any widening
+
+namespace {
+
+__attribute__((target("avx2"))) int64_t SumBytesAvx2(const uint8_t* a, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(block, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    uint64_t result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; ++i) {
+        result += a[i];
+    }
+    return result;
+}
+
+int64_t SumBytesSse2(const uint8_t* a, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(block, _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    uint64_t result = lanes[0] + lanes[1];
+    for (; i < n; ++i) {
+        result += a[i];
+    }
+    return result;
+}
+
+}  // namespace
+
+int64_t KernelSum(const uint8_t* a, size_t n) {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? SumBytesAvx2(a, n) : SumBytesSse2(a, n);
+}
+
+#else
+
+int64_t KernelSum(const uint8_t* a, size_t n) {
+    return SumBytes(a, n);
+}
+
+#endif
+
+KERNEL int64_t KernelSum(const int64_t* a, size_t n) {
+    return Sum(Unsigned(a), n);
+}
+
+KERNEL double KernelSum(const double* a, size_t n) {
+    return Sum(a, n);
+}
+
+KERNEL int64_t KernelDot(const uint8_t* a, const uint8_t* b, size_t n) {
+    return DotBytes(a, b, n);
+}
+
+KERNEL int64_t KernelDot(const int64_t* a, const int64_t* b, size_t n) {
+    return Dot(Unsigned(a), Unsigned(b), n);
+}
+
+KERNEL double KernelDot(const double* a, const double* b, size_t n) {
+    return Dot(a, b, n);
+}
+
+KERNEL uint8_t KernelMin(const uint8_t* a, size_t n) {
+    return Reduce(a, n, PickMin());
+}
+
+KERNEL int64_t KernelMin(const int64_t* a, size_t n) {
+    return Reduce(a, n, PickMin());
+}
+
+KERNEL double KernelMin(const double* a, size_t n) {
+    return Reduce(a, n, PickMin());
+}
+
+KERNEL uint8_t KernelMax(const uint8_t* a, size_t n) {
+    return Reduce(a, n, PickMax());
+}
+
+KERNEL int64_t KernelMax(const int64_t* a, size_t n) {
+    return Reduce(a, n, PickMax());
+}
+
+KERNEL double KernelMax(const double* a, size_t n) {
+    return Reduce(a, n, PickMax());
+}
+
+KERNEL void KernelAdd(const uint8_t* a, const uint8_t* b, uint8_t* out, size_t n) {
+    Map(a, b, out, n, Plus());
+}
+
+KERNEL void KernelAdd(const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    Map(Unsigned(a), Unsigned(b), Unsigned(out), n, Plus());
+}
+
+KERNEL void KernelAdd(const double* a, const double* b, double* out, size_t n) {
+    Map(a, b, out, n, Plus());
+}
+
+KERNEL void KernelMul(const uint8_t* a, const uint8_t* b, uint8_t* out, size_t n) {
+    Map(a, b, out, n, Times());
+}
+
+KERNEL void KernelMul(const int64_t* a, const int64_t* b, int64_t* out, size_t n) {
+    Map(Unsigned(a), Unsigned(b), Unsigned(out), n, Times());
+}
+
+KERNEL void KernelMul(const double* a, const double* b, double* out, size_t n) {
+    Map(a, b, out, n, Times());
+}
+
+KERNEL void KernelScale(const uint8_t* a, uint8_t k, uint8_t* out, size_t n) {
+    Scale(a, k, out, n);
+}
+
+KERNEL void KernelScale(const int64_t* a, int64_t k, int64_t* out, size_t n) {
+    Scale(Unsigned(a), uint64_t(k), Unsigned(out), n);
+}
+
+KERNEL void KernelScale(const double* a, double k, double* out, size_t n) {
+    Scale(a, k, out, n);
+}
@@ -0,0 +1,59 @@
+// Checks what the tokenizer makes of numbers, signs and dots. Exits with 1 and reports
+// every input whose tokens differ from the expected ones.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tokenizer.h"
+
+std::vector<Token> ReadTokens(const std::string& text) {
+    std::stringstream ss(text);
+    Tokenizer tokenizer(&ss);
+    std::vector<Token> tokens;
+    while (!tokenizer.IsEnd()) {
+        tokens.push_back(tokenizer.GetToken());
+        tokenizer.Next();
+    }
+    return tokens;
+}
+
+int main() {
+    struct Case {
+        std::string text;
+        std::vector<Token> tokens;
+    };
+    std::vector<Case> cases = {
+        {"5", {ConstantToken(5)}},
+        {"-5", {ConstantToken(-5)}},
+        {"+5", {ConstantToken(5)}},
+        {"1.5", {RealToken(1.5)}},
+        {".5", {RealToken(0.5)}},
+        {"-.5", {RealToken(-0.5)}},
+        {"+.5", {RealToken(0.5)}},
+        {"-.5e1", {RealToken(-5)}},
+        {"-", {SymbolToken("-")}},
+        {"+", {SymbolToken("+")}},
+        {"(- .5)", {BracketToken::OPEN, SymbolToken("-"), RealToken(0.5), BracketToken::CLOSE}},
+        {"(a . b)",
+         {BracketToken::OPEN, SymbolToken("a"), DotToken(), SymbolToken("b"),
+          BracketToken::CLOSE}},
+        {"(a .5)", {BracketToken::OPEN, SymbolToken("a"), RealToken(0.5), BracketToken::CLOSE}},
+        {"- .", {SymbolToken("-"), DotToken()}},
+    };
+
+    int failed = 0;
+    for (auto& x : cases) {
+        try {
+            if (ReadTokens(x.text) != x.tokens) {
+                std::cerr << "Unexpected tokens for '" << x.text << "'" << std::endl;
+                failed = 1;
+            }
+        } catch (const std::exception& err) {
+            std::cerr << "Could not tokenize '" << x.text << "': " << err.what() << std::endl;
+            failed = 1;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,94 @@
+// Load generator for `scheme --serve`.
+//
+// Opens CONNECTIONS connections to the server, sends REQUESTS requests in total, each
+// evaluating EXPR, and reports the throughput and the latency distribution.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+using Clock = std::chrono::steady_clock;
+
+int Connect(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: scheme-loadgen SOCKET EXPR [REQUESTS] [CONNECTIONS]" << std::endl;
+        return 1;
+    }
+    std::string path = argv[1];
+    std::string expr = argv[2];
+    size_t requests = argc > 3 ? std::stoul(argv[3]) : 10000;
+    size_t connections = argc > 4 ? std::stoul(argv[4]) : 1;
+
+    std::vector<std::vector<double>> latencies(connections);
+    std::vector<size_t> failures(connections);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < connections; ++i) {
+        size_t count = requests / connections + (i < requests % connections ? 1 : 0);
+        threads.emplace_back([&, i, count] {
+            int fd = Connect(path);
+            if (fd < 0) {
+                failures[i] = count;
+                return;
+            }
+            ResponseStatus status;
+            std::string payload;
+            for (size_t j = 0; j < count; ++j) {
+                auto sent = Clock::now();
+                if (!WriteRequest(fd, expr) || !ReadResponse(fd, &status, &payload)) {
+                    failures[i] += count - j;
+                    break;
+                }
+                std::chrono::duration<double, std::micro> latency = Clock::now() - sent;
+                latencies[i].push_back(latency.count());
+                if (status != ResponseStatus::OK) {
+                    ++failures[i];
+                }
+            }
+            close(fd);
+        });
+    }
+    for (auto& x : threads) {
+        x.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    std::vector<double> all;
+    size_t failed = 0;
+    for (size_t i = 0; i < connections; ++i) {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+        failed += failures[i];
+    }
+    if (all.empty()) {
+        std::cerr << "No request succeeded" << std::endl;
+        return 1;
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) { return all[std::min(all.size() - 1, size_t(p * all.size()))]; };
+    std::cout << "requests:   " << all.size() << " (" << failed << " failed)" << std::endl;
+    std::cout << "throughput: " << all.size() / elapsed.count() << " req/s" << std::endl;
+    std::cout << "latency us: p50 " << percentile(0.5) << ", p90 " << percentile(0.9) << ", p99 "
+              << percentile(0.99) << ", max " << all.back() << std::endl;
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Benchmark for parallel-map.
+//
+// Maps a CPU-bound function, a naive Fibonacci of N, over ITEMS numbers with map and then
+// with parallel-map on pools of 1, 2, 4 and 8 threads, and reports the time of each and the
+// speedup over map. The size of the pool is fixed once it is first used, so every
+// measurement runs in a child process of its own.
+
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "scheme.h"
+
+using Clock = std::chrono::steady_clock;
+
+const char* kFib = "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))";
+
+// Seconds the child took to evaluate expr with threads workers in the pool, or a negative
+// number if it failed
+double Measure(size_t threads, const std::string& setup, const std::string& expr) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        setenv("SCHEME_THREADS", std::to_string(threads).c_str(), 1);
+        double seconds = -1;
+        try {
+            Interpreter interp;
+            interp.Run(kFib);
+            interp.Run(setup);
+            // Warms the pool up, its threads are started on first use
+            interp.Run("(parallel-map (lambda (x) x) '(1))");
+            auto start = Clock::now();
+            interp.Run(expr);
+            seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        } catch (const std::exception& err) {
+            std::cerr << "Evaluation failed: " << err.what() << std::endl;
+        }
+        ssize_t written = write(fds[1], &seconds, sizeof(seconds));
+        _exit(written == sizeof(seconds) ? 0 : 1);
+    }
+    close(fds[1]);
+    double seconds = -1;
+    if (read(fds[0], &seconds, sizeof(seconds)) != sizeof(seconds)) {
+        seconds = -1;
+    }
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    return seconds;
+}
+
+int main(int argc, char** argv) {
+    size_t items = argc > 1 ? std::stoul(argv[1]) : 64;
+    size_t n = argc > 2 ? std::stoul(argv[2]) : 22;
+    std::string chunk_size = argc > 3 ? argv[3] : "";
+    if (items == 0) {
+        std::cerr << "Usage: scheme-parallel-bench [ITEMS] [N] [CHUNK_SIZE]" << std::endl;
+        return 1;
+    }
+    std::string setup = "(define items (do ((i 0 (+ i 1)) (acc '() (cons " + std::to_string(n) +
+                        " acc))) ((= i " + std::to_string(items) + ") acc)))";
+
+    double sequential = Measure(1, setup, "(map fib items)");
+    if (sequential < 0) {
+        return 1;
+    }
+    std::cout << "items " << items << ", (fib " << n << ") each" << std::endl;
+    std::cout << "threads  seconds   speedup" << std::endl;
+    std::cout << std::left << std::fixed << std::setw(9) << "map" << std::setw(10)
+              << std::setprecision(3) << sequential << std::setprecision(2) << 1.0 << std::endl;
+    for (size_t threads : {1, 2, 4, 8}) {
+        double seconds =
+            Measure(threads, setup, "(parallel-map fib items " + chunk_size + ")");
+        if (seconds < 0) {
+            return 1;
+        }
+        std::cout << std::setw(9) << threads << std::setw(10) << std::setprecision(3) << seconds
+                  << std::setprecision(2) << sequential / seconds << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+// Stress test for interpreters running side by side in one process.
+//
+// For 1, 2, 4, ... up to THREADS threads, every thread evaluates EXPR RUNS times in an
+// interpreter of its own. Reports the total throughput, the speedup over a single thread,
+// which should grow about linearly while there are cores to spare, and every result that
+// differs from what a lone interpreter computed.
+
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "scheme.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Conses a list and walks it, so that every run allocates and collects garbage too
+const char* kDefaultExpr =
+    "(do ((i 0 (+ i 1)) (acc '() (cons (* i i) acc))) ((= i 2000) (length acc)))";
+
+int main(int argc, char** argv) {
+    size_t max_threads = argc > 1 ? std::stoul(argv[1]) : std::thread::hardware_concurrency();
+    size_t runs = argc > 2 ? std::stoul(argv[2]) : 1000;
+    std::string expr = argc > 3 ? argv[3] : kDefaultExpr;
+    if (max_threads == 0 || runs == 0) {
+        std::cerr << "Usage: scheme-stress [THREADS] [RUNS] [EXPR]" << std::endl;
+        return 1;
+    }
+
+    std::string expected;
+    try {
+        expected = Interpreter().Run(expr);
+    } catch (const std::exception& err) {
+        std::cerr << "Evaluation failed: " << err.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<size_t> counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(max_threads);
+
+    double single_throughput = 0;
+    size_t failed = 0;
+    std::cout << "threads  runs/s      speedup  mismatches" << std::endl;
+    for (size_t threads : counts) {
+        // Interpreters are set up before the clock starts, only evaluation is measured
+        std::vector<std::unique_ptr<Interpreter>> interpreters;
+        for (size_t i = 0; i < threads; ++i) {
+            interpreters.push_back(std::make_unique<Interpreter>());
+        }
+        std::vector<size_t> mismatches(threads);
+        auto start = Clock::now();
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([&, i] {
+                for (size_t j = 0; j < runs; ++j) {
+                    try {
+                        if (interpreters[i]->Run(expr) != expected) {
+                            ++mismatches[i];
+                        }
+                    } catch (const std::exception&) {
+                        ++mismatches[i];
+                    }
+                }
+            });
+        }
+        for (auto& x : workers) {
+            x.join();
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+
+        size_t mismatched = 0;
+        for (auto& x : mismatches) {
+            mismatched += x;
+        }
+        failed += mismatched;
+        double throughput = threads * runs / elapsed.count();
+        if (threads == 1) {
+            single_throughput = throughput;
+        }
+        std::cout << std::left << std::setw(9) << threads << std::setw(12) << std::fixed
+                  << std::setprecision(0) << throughput << std::setw(9) << std::setprecision(2)
+                  << throughput / single_throughput << mismatched << std::endl;
+    }
+    return failed == 0 ? 0 : 1;
+}